@@ -0,0 +1,1277 @@
+/*
+ * File: bench.c
+ * 	mmap latency and throughput benchmark for
+ * 	container IMA. Forks one process per UTS
+ * 	namespace, each hammering PROT_EXEC mmaps
+ * 	from several threads, and reports latency
+ * 	percentiles and measurements per second
+ *
+ * 	Cases:
+ * 	  none    probe not attached, baseline mmap cost
+ * 	  cold    probe attached, every mapping is a new file
+ * 	  warm    probe attached, files already measured
+ * 	  shared  probe attached, all namespaces map the
+ * 	          same new file, one digest many measurements
+ * 	  exec    probe attached, threads fork and exec a new
+ * 	          copy of ima_bench that exits at once; calls/op
+ * 	          is the module calls per execve
+ * 	  dedup   probe attached, every thread of every namespace
+ * 	          maps one new file at once; fails unless the
+ * 	          module hashed it exactly once
+ * 	  reexec  probe attached, the exec case repeated on one
+ * 	          copy that every namespace already exec'd; fails
+ * 	          unless the copy was hashed exactly once in all
+ * 	  append  probe attached, every namespace maps the same
+ * 	          new files per thread, repeated on 1, 2, 4, ...
+ * 	          of the available CPUs; meas/s is the rate of
+ * 	          namespace log appends against the cpus column
+ *
+ * 	--verity enables fs-verity on every file, so the module
+ * 	measures the verity digest instead of reading the file
+ *
+ * 	--algos repeats the cases for each hash algorithm, set as
+ * 	the container policy of the benchmark namespaces, and
+ * 	reports the driver and hashing MB/s of each
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fsverity.h>
+
+#define MODULE_STATS "/sys/kernel/debug/container_ima/stats"
+#define MODULE_HASHES "/sys/kernel/debug/container_ima/hashes"
+#define MODULE_VERITY "/sys/kernel/debug/container_ima/verity_digests"
+#define MODULE_DRIVERS "/sys/kernel/debug/container_ima/drivers"
+#define MODULE_AHASH_MINSIZE "/sys/module/container_ima/parameters/ahash_minsize"
+#define MODULE_REUSE_IINT "/sys/module/container_ima/parameters/reuse_iint"
+#define MODULE_TPM_BATCH "/sys/module/container_ima/parameters/tpm_batch"
+#define PROBE_SETTLE_SEC 1
+#define MAX_SIZES 16
+#define MAX_ALGOS 8
+#define EXEC_CHILD "--exec-child"
+
+enum bench_case {
+	CASE_NONE,
+	CASE_COLD,
+	CASE_WARM,
+	CASE_SHARED,
+	CASE_EXEC,
+	CASE_DEDUP,
+	CASE_REEXEC,
+	CASE_APPEND,
+	CASE_MAX,
+};
+
+static const char * const case_names[CASE_MAX] = {
+	[CASE_NONE] = "none",
+	[CASE_COLD] = "cold",
+	[CASE_WARM] = "warm",
+	[CASE_SHARED] = "shared",
+	[CASE_EXEC] = "exec",
+	[CASE_DEDUP] = "dedup",
+	[CASE_REEXEC] = "reexec",
+	[CASE_APPEND] = "append",
+};
+
+struct bench_config {
+	int namespaces;
+	int threads;
+	int iterations;
+	int files;
+	size_t sizes[MAX_SIZES];
+	int nr_sizes;
+	unsigned int cases;
+	const char *dir;
+	const char *probe;
+	FILE *csv;
+	int *ns_fds;
+	bool verity;
+	char *algos[MAX_ALGOS];
+	int nr_algos;
+	const char *algo;	/* current algorithm, NULL for default */
+	cpu_set_t cpuset;	/* CPUs the benchmark may use */
+	int nr_cpus;
+	int cpus;		/* workers run on the first cpus, 0 for all */
+};
+
+/* Shared between the forked namespaces */
+struct bench_shared {
+	volatile int ready;
+	volatile int go;
+	uint64_t samples[];
+};
+
+struct bench_run {
+	const struct bench_config *cfg;
+	enum bench_case bcase;
+	size_t size;
+	int round;
+	int ns;
+	int thread;
+	uint64_t *samples;
+	int count;
+};
+
+static struct bench_shared *shared;
+static pid_t probe_pid;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * file_path
+ * 	Name of a benchmark file. Warm files are shared by every
+ * 	worker, cold files are private to one (ns, thread) and
+ * 	shared files to one index across namespaces, append files to
+ * 	one (thread, index) across namespaces. The dedup file is
+ * 	mapped by everyone. round keeps every inode but the warm
+ * 	ones new on every invocation.
+ */
+static void file_path(const struct bench_run *run, int index, char *buf,
+		      size_t len)
+{
+	const struct bench_config *cfg = run->cfg;
+	const char *tag = cfg->verity ? "verity-" : "";
+
+	switch (run->bcase) {
+	case CASE_COLD:
+		snprintf(buf, len, "%s/%scold-%zu-%d-%d-%d-%d", cfg->dir, tag,
+			 run->size, run->round, run->ns, run->thread, index);
+		break;
+	case CASE_SHARED:
+		snprintf(buf, len, "%s/%sshared-%zu-%d-%d", cfg->dir, tag,
+			 run->size, run->round, index);
+		break;
+	case CASE_EXEC:
+		snprintf(buf, len, "%s/exec-%d", cfg->dir, run->round);
+		break;
+	case CASE_REEXEC:
+		snprintf(buf, len, "%s/reexec-%d", cfg->dir, run->round);
+		break;
+	case CASE_DEDUP:
+		snprintf(buf, len, "%s/dedup-%zu-%d", cfg->dir, run->size,
+			 run->round);
+		break;
+	case CASE_APPEND:
+		snprintf(buf, len, "%s/%sappend-%zu-%d-%d-%d", cfg->dir, tag,
+			 run->size, run->round, run->thread, index);
+		break;
+	default:
+		snprintf(buf, len, "%s/%swarm-%zu-%d", cfg->dir, tag,
+			 run->size, index % cfg->files);
+		break;
+	}
+}
+
+/* Seal path with fs-verity, the filesystem must support it */
+static int enable_verity(const char *path)
+{
+	struct fsverity_enable_arg arg = {
+		.version = 1,
+		.hash_algorithm = FS_VERITY_HASH_ALG_SHA256,
+		.block_size = 4096,
+	};
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (ioctl(fd, FS_IOC_ENABLE_VERITY, &arg))
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+static int write_file(const char *path, size_t size, unsigned int seed,
+		      bool verity)
+{
+	char buf[65536];
+	size_t done, chunk, i;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	if (fd < 0)
+		return -errno;
+
+	for (done = 0; done < size; done += chunk) {
+		chunk = size - done < sizeof(buf) ? size - done : sizeof(buf);
+		/* Distinct content per file, digests must not collide */
+		for (i = 0; i < chunk; i++)
+			buf[i] = (char) (seed * 2654435761u + done + i);
+		if (write(fd, buf, chunk) != (ssize_t) chunk) {
+			close(fd);
+			return -EIO;
+		}
+	}
+
+	if (close(fd))
+		return -errno;
+	return verity ? enable_verity(path) : 0;
+}
+
+/* Copy of this benchmark, exec'd by the exec case */
+static int copy_self(const char *path)
+{
+	char buf[65536];
+	ssize_t len;
+	int in, out, ret = 0;
+
+	in = open("/proc/self/exe", O_RDONLY);
+	if (in < 0)
+		return -errno;
+	out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	if (out < 0) {
+		close(in);
+		return -errno;
+	}
+
+	while ((len = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, len) != len) {
+			ret = -EIO;
+			break;
+		}
+	if (len < 0)
+		ret = -errno;
+
+	close(in);
+	if (close(out) && !ret)
+		ret = -errno;
+	return ret;
+}
+
+/* Number of mappings one thread performs for a case */
+static int run_count(const struct bench_config *cfg, enum bench_case bcase)
+{
+	switch (bcase) {
+	case CASE_COLD:
+	case CASE_SHARED:
+	case CASE_APPEND:
+		return cfg->files;
+	case CASE_DEDUP:
+		return 1;
+	default:
+		return cfg->iterations;
+	}
+}
+
+/*
+ * prepare_files
+ * 	Create the files a case maps. Done before the timed run so
+ * 	writes and i_version bumps are not measured.
+ */
+static int prepare_files(const struct bench_config *cfg,
+			 enum bench_case bcase, size_t size, int round)
+{
+	struct bench_run run = { .cfg = cfg, .bcase = bcase,
+				 .size = size, .round = round };
+	char path[4096];
+	unsigned int seed = 0;
+	/* Append files are per thread only, namespaces share them */
+	int nr_ns = bcase == CASE_APPEND ? 1 : cfg->namespaces;
+	int i, ret;
+
+	if (bcase == CASE_EXEC) {
+		file_path(&run, 0, path, sizeof(path));
+		return copy_self(path);
+	}
+
+	/* Kept for the timed pass after the untimed one */
+	if (bcase == CASE_REEXEC) {
+		file_path(&run, 0, path, sizeof(path));
+		return access(path, F_OK) ? copy_self(path) : 0;
+	}
+
+	/* Plain file, a verity digest is not a hash */
+	if (bcase == CASE_DEDUP) {
+		file_path(&run, 0, path, sizeof(path));
+		return write_file(path, size, round * 15485863u, false);
+	}
+
+	if (bcase == CASE_COLD || bcase == CASE_APPEND) {
+		for (run.ns = 0; run.ns < nr_ns; run.ns++)
+			for (run.thread = 0; run.thread < cfg->threads;
+			     run.thread++)
+				for (i = 0; i < cfg->files; i++) {
+					file_path(&run, i, path, sizeof(path));
+					ret = write_file(path, size, ++seed +
+							 round * 7919,
+							 cfg->verity);
+					if (ret)
+						return ret;
+				}
+		return 0;
+	}
+
+	for (i = 0; i < cfg->files; i++) {
+		file_path(&run, i, path, sizeof(path));
+		if (bcase != CASE_SHARED && !access(path, F_OK))
+			continue;
+		ret = write_file(path, size, i + round * 104729,
+				 cfg->verity);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Latency of one fork, execve and exit of path */
+static uint64_t exec_once(const char *path)
+{
+	uint64_t start = now_ns();
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return UINT64_MAX;
+	if (!pid) {
+		execl(path, path, EXEC_CHILD, NULL);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		return UINT64_MAX;
+	return now_ns() - start;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_run *run = arg;
+	char path[4096];
+	uint64_t start;
+	void *addr;
+	int i, fd, index;
+
+	while (!shared->go)
+		;
+
+	for (i = 0; i < run->count; i++) {
+		/* Cold and shared names already encode the worker, warm
+		 * threads spread over the common pool */
+		index = run->bcase == CASE_COLD || run->bcase == CASE_SHARED ||
+			run->bcase == CASE_DEDUP || run->bcase == CASE_APPEND ?
+			i : i + run->thread * run->count;
+		file_path(run, index, path, sizeof(path));
+
+		if (run->bcase == CASE_EXEC || run->bcase == CASE_REEXEC) {
+			run->samples[i] = exec_once(path);
+			continue;
+		}
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			run->samples[i] = UINT64_MAX;
+			continue;
+		}
+
+		start = now_ns();
+		addr = mmap(NULL, run->size, PROT_READ | PROT_EXEC,
+			    MAP_PRIVATE, fd, 0);
+		run->samples[i] = now_ns() - start;
+
+		if (addr == MAP_FAILED)
+			run->samples[i] = UINT64_MAX;
+		else
+			munmap(addr, run->size);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Keep the calling process to the first cfg->cpus usable CPUs */
+static int restrict_cpus(const struct bench_config *cfg)
+{
+	cpu_set_t set;
+	int cpu, n = 0;
+
+	CPU_ZERO(&set);
+	for (cpu = 0; cpu < CPU_SETSIZE && n < cfg->cpus; cpu++)
+		if (CPU_ISSET(cpu, &cfg->cpuset)) {
+			CPU_SET(cpu, &set);
+			n++;
+		}
+	return sched_setaffinity(0, sizeof(set), &set) ? -errno : 0;
+}
+
+/*
+ * bench_namespace
+ * 	Body of one forked worker: join UTS namespace ns, the
+ * 	identity container IMA measures under, and run the threads
+ */
+static int bench_namespace(const struct bench_config *cfg,
+			   enum bench_case bcase, size_t size, int round,
+			   int ns)
+{
+	int count = run_count(cfg, bcase);
+	struct bench_run runs[cfg->threads];
+	pthread_t tids[cfg->threads];
+	int i;
+
+	if (setns(cfg->ns_fds[ns], CLONE_NEWUTS)) {
+		perror("setns");
+		return 1;
+	}
+
+	/* The threads inherit the CPUs of the sweep step */
+	if (cfg->cpus && restrict_cpus(cfg)) {
+		perror("sched_setaffinity");
+		return 1;
+	}
+
+	for (i = 0; i < cfg->threads; i++) {
+		runs[i] = (struct bench_run) {
+			.cfg = cfg, .bcase = bcase, .size = size,
+			.round = round, .ns = ns, .thread = i,
+			.count = count,
+			.samples = shared->samples +
+				   ((size_t) ns * cfg->threads + i) * count,
+		};
+		if (pthread_create(&tids[i], NULL, bench_thread, &runs[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	__atomic_add_fetch(&shared->ready, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < cfg->threads; i++)
+		pthread_join(tids[i], NULL);
+	return 0;
+}
+
+/* Module counters, differences give the work of one run */
+struct module_counters {
+	uint64_t measurements;	/* misses of the measure stage */
+	uint64_t hashes;	/* file hashes */
+	uint64_t verity;	/* fs-verity digests used */
+	uint64_t calls;		/* bpf_process_measurement calls */
+};
+
+/* Sum of the bucket counts that end a stats line */
+static uint64_t hist_total(const char *buckets)
+{
+	unsigned long long value;
+	uint64_t total = 0;
+	int len;
+
+	while (sscanf(buckets, "%llu%n", &value, &len) == 1) {
+		total += value;
+		buckets += len;
+	}
+	return total;
+}
+
+/*
+ * module_counters
+ * 	Counters of the module so far, zero when it is not loaded.
+ * 	Calls are the samples of the mmap stage, which times every
+ * 	bpf_process_measurement call while stats are enabled.
+ */
+static void module_counters(struct module_counters *c)
+{
+	unsigned long long hits, misses, errors;
+	char line[1024], name[64];
+	FILE *f;
+	int len;
+
+	memset(c, 0, sizeof(*c));
+
+	f = fopen(MODULE_STATS, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "%63s %llu %llu %llu%n", name, &hits,
+				   &misses, &errors, &len) != 4)
+				continue;
+			if (!strcmp(name, "measure"))
+				c->measurements = misses;
+			else if (!strcmp(name, "mmap"))
+				c->calls = hist_total(line + len);
+		}
+		fclose(f);
+	}
+
+	f = fopen(MODULE_HASHES, "r");
+	if (f) {
+		if (fscanf(f, "%llu", &misses) == 1)
+			c->hashes = misses;
+		fclose(f);
+	}
+
+	f = fopen(MODULE_VERITY, "r");
+	if (f) {
+		if (fscanf(f, "%llu", &misses) == 1)
+			c->verity = misses;
+		fclose(f);
+	}
+}
+
+/*
+ * create_namespaces
+ * 	Create the UTS namespaces once, so warm runs map files from
+ * 	the namespaces that measured them. A child unshares and the
+ * 	parent keeps the namespace alive through an fd.
+ */
+static int create_namespaces(struct bench_config *cfg)
+{
+	char path[64];
+	int i, sync[2], ret = 0;
+	pid_t pid;
+
+	cfg->ns_fds = calloc(cfg->namespaces, sizeof(int));
+	if (!cfg->ns_fds)
+		return -ENOMEM;
+
+	for (i = 0; i < cfg->namespaces && !ret; i++) {
+		if (pipe(sync))
+			return -errno;
+
+		pid = fork();
+		if (pid < 0) {
+			ret = -errno;
+			break;
+		}
+		if (!pid) {
+			char c = unshare(CLONE_NEWUTS) ? 1 : 0;
+
+			if (write(sync[1], &c, 1) != 1 || c)
+				_exit(1);
+			pause();
+			_exit(0);
+		}
+
+		close(sync[1]);
+		{
+			char c = 1;
+
+			if (read(sync[0], &c, 1) != 1 || c) {
+				ret = -EPERM;
+			} else {
+				snprintf(path, sizeof(path), "/proc/%d/ns/uts",
+					 pid);
+				cfg->ns_fds[i] = open(path, O_RDONLY);
+				if (cfg->ns_fds[i] < 0)
+					ret = -errno;
+			}
+		}
+		close(sync[0]);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+	return ret;
+}
+
+/* Remove the single-use cold and shared files of a run */
+static void remove_files(const struct bench_config *cfg,
+			 enum bench_case bcase, size_t size, int round)
+{
+	struct bench_run run = { .cfg = cfg, .bcase = bcase,
+				 .size = size, .round = round };
+	char path[4096];
+	int nr_ns = bcase == CASE_APPEND ? 1 : cfg->namespaces;
+	int i;
+
+	if (bcase == CASE_EXEC || bcase == CASE_DEDUP || 
+	    bcase == CASE_REEXEC) {
+		file_path(&run, 0, path, sizeof(path));
+		unlink(path);
+		return;
+	}
+
+	if (bcase == CASE_SHARED) {
+		for (i = 0; i < cfg->files; i++) {
+			file_path(&run, i, path, sizeof(path));
+			unlink(path);
+		}
+		return;
+	}
+
+	for (run.ns = 0; run.ns < nr_ns; run.ns++)
+		for (run.thread = 0; run.thread < cfg->threads; run.thread++)
+			for (i = 0; i < cfg->files; i++) {
+				file_path(&run, i, path, sizeof(path));
+				unlink(path);
+			}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+	size_t i = (size_t) (p * (n - 1) + 0.5);
+
+	return n ? sorted[i] : 0;
+}
+
+static int probe_start(const struct bench_config *cfg)
+{
+	if (probe_pid)
+		return 0;
+
+	probe_pid = fork();
+	if (probe_pid < 0) {
+		probe_pid = 0;
+		return -errno;
+	}
+	if (!probe_pid) {
+		execl(cfg->probe, cfg->probe, "-o", "/dev/null", NULL);
+		perror(cfg->probe);
+		_exit(127);
+	}
+
+	sleep(PROBE_SETTLE_SEC);
+	if (waitpid(probe_pid, NULL, WNOHANG) == probe_pid) {
+		fprintf(stderr, "%s exited, is container_ima loaded?\n",
+			cfg->probe);
+		probe_pid = 0;
+		return -ECHILD;
+	}
+	return 0;
+}
+
+static void probe_stop(void)
+{
+	if (!probe_pid)
+		return;
+
+	kill(probe_pid, SIGINT);
+	waitpid(probe_pid, NULL, 0);
+	probe_pid = 0;
+}
+
+/* Run probe policy ARGS... and wait for it */
+static int probe_policy(const struct bench_config *cfg, const char *cmd,
+			const char *key, const char *mode)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (!pid) {
+		execl(cfg->probe, cfg->probe, "policy", cmd, key, mode, NULL);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * policy_apply
+ * 	Measure the benchmark namespaces with cfg->algo through the
+ * 	container policy map the probe pins, or drop their entries
+ * 	so the module default applies
+ */
+static int policy_apply(const struct bench_config *cfg)
+{
+	char key[64], mode[64];
+	struct stat st;
+	int i, ret = 0;
+
+	for (i = 0; i < cfg->namespaces && !ret; i++) {
+		if (fstat(cfg->ns_fds[i], &st))
+			return -errno;
+		snprintf(key, sizeof(key), "ns:%llu",
+			 (unsigned long long) st.st_ino);
+		if (!cfg->algo) {
+			probe_policy(cfg, "del", key, NULL);
+			continue;
+		}
+		snprintf(mode, sizeof(mode), "measure:%s", cfg->algo);
+		ret = probe_policy(cfg, "set", key, mode);
+	}
+	if (ret)
+		fprintf(stderr, "cannot set policy %s\n", mode);
+	return ret;
+}
+
+/*
+ * hash_driver
+ * 	Driver the module hashes files of size with algo, from its
+ * 	drivers list and ahash_minsize. "-" when unknown.
+ */
+static void hash_driver(const char *algo, size_t size, char *buf,
+			size_t len)
+{
+	char line[256], name[64], shash[96], ahash[96];
+	unsigned long long minsize = 0;
+	FILE *f;
+
+	snprintf(buf, len, "-");
+	if (!algo)
+		return;
+
+	f = fopen(MODULE_AHASH_MINSIZE, "r");
+	if (f) {
+		if (fscanf(f, "%llu", &minsize) != 1)
+			minsize = 0;
+		fclose(f);
+	}
+
+	f = fopen(MODULE_DRIVERS, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %95s %95s", name, shash, ahash) != 3 ||
+		    strcmp(name, algo))
+			continue;
+		snprintf(buf, len, "%s", minsize && size >= minsize &&
+			 strcmp(ahash, "-") ? ahash : shash);
+		break;
+	}
+	fclose(f);
+}
+
+/*
+ * exec_prime
+ * 	Exec this benchmark from namespace 0, so the loader and
+ * 	libraries it maps are hashed before a reexec run counts
+ */
+static int exec_prime(const struct bench_config *cfg)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (!pid) {
+		if (setns(cfg->ns_fds[0], CLONE_NEWUTS))
+			_exit(1);
+		execl("/proc/self/exe", "/proc/self/exe", EXEC_CHILD, NULL);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		return -ECHILD;
+	return 0;
+}
+
+/*
+ * param_set
+ * 	Set a container_ima parameter through sysfs, its previous
+ * 	value goes to old unless it is NULL
+ */
+static int param_set(const char *path, const char *value, char *old,
+		     size_t len)
+{
+	FILE *f;
+
+	if (old) {
+		f = fopen(path, "r");
+		if (!f)
+			return -errno;
+		if (!fgets(old, len, f))
+			old[0] = 0;
+		old[strcspn(old, "\n")] = 0;
+		fclose(f);
+	}
+
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+	fputs(value, f);
+	return fclose(f) ? -errno : 0;
+}
+
+/*
+ * run_case
+ * 	Run one case for one file size and, if report is set,
+ * 	print a result row
+ */
+static int run_case(const struct bench_config *cfg, enum bench_case bcase,
+		    size_t size, int round, bool report)
+{
+	size_t count = run_count(cfg, bcase);
+	size_t total = count * cfg->threads * cfg->namespaces;
+	struct module_counters before, after, first;
+	uint64_t start, elapsed, *sorted;
+	size_t i, n = 0, failed = 0;
+	int ns, status, ret = 0;
+	char driver[96], reuse_iint[8] = "";
+	double secs, mbps;
+	pid_t *pids;
+
+	if (bcase == CASE_NONE) {
+		probe_stop();
+	} else {
+		ret = probe_start(cfg);
+		if (!ret && report)
+			ret = policy_apply(cfg);
+		if (ret)
+			return ret;
+	}
+
+	ret = prepare_files(cfg, bcase, size, round);
+	if (ret) {
+		fprintf(stderr, "creating files in %s: %s\n", cfg->dir,
+			strerror(-ret));
+		return ret;
+	}
+
+	/* Warm: one untimed pass so every namespace has measured */
+	if (bcase == CASE_WARM && report) {
+		ret = run_case(cfg, CASE_WARM, size, round, false);
+		if (ret)
+			return ret;
+	}
+
+	/* Reexec: every namespace execs the copy once untimed, the
+	 * hashes of the whole case are counted from here */
+	if (bcase == CASE_REEXEC && report) {
+		ret = exec_prime(cfg);
+		module_counters(&first);
+		if (!ret)
+			ret = run_case(cfg, CASE_REEXEC, size, round, false);
+		if (ret) {
+			remove_files(cfg, bcase, size, round);
+			return ret;
+		}
+	}
+
+	/* The digest host IMA collects would count as no hash at all */
+	if ((bcase == CASE_DEDUP || bcase == CASE_REEXEC) &&
+	    param_set(MODULE_REUSE_IINT, "N", reuse_iint, sizeof(reuse_iint)))
+		reuse_iint[0] = 0;
+
+	shared->ready = 0;
+	shared->go = 0;
+	memset(shared->samples, 0, total * sizeof(uint64_t));
+
+	pids = calloc(cfg->namespaces, sizeof(*pids));
+	if (!pids)
+		return -ENOMEM;
+
+	for (ns = 0; ns < cfg->namespaces; ns++) {
+		pids[ns] = fork();
+		if (pids[ns] < 0) {
+			ret = -errno;
+			break;
+		}
+		if (!pids[ns])
+			_exit(bench_namespace(cfg, bcase, size, round, ns));
+	}
+
+	while (!ret && shared->ready < cfg->namespaces)
+		usleep(1000);
+
+	module_counters(&before);
+	start = now_ns();
+	shared->go = 1;
+
+	for (i = 0; i < (size_t) ns; i++) {
+		if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			ret = ret ? ret : -ECHILD;
+	}
+	elapsed = now_ns() - start;
+	module_counters(&after);
+	free(pids);
+
+	if (reuse_iint[0])
+		param_set(MODULE_REUSE_IINT, reuse_iint, NULL, 0);
+
+	if (bcase != CASE_NONE && bcase != CASE_WARM &&
+	    (bcase != CASE_REEXEC || report))
+		remove_files(cfg, bcase, size, round);
+	if (ret || !report)
+		return ret;
+
+	sorted = malloc(total * sizeof(*sorted));
+	if (!sorted)
+		return -ENOMEM;
+	for (i = 0; i < total; i++) {
+		if (shared->samples[i] == UINT64_MAX)
+			failed++;
+		else
+			sorted[n++] = shared->samples[i];
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp_u64);
+
+	secs = elapsed / 1e9;
+	/* Every hash reads the whole file */
+	mbps = (after.hashes - before.hashes) * (double) size / secs / 1e6;
+	hash_driver(cfg->algo, size, driver, sizeof(driver));
+
+	printf("%-7s %10zu %4d %4d %8zu %6zu %10.1f %10.1f %10.1f %10.1f "
+	       "%12.0f %12.0f %10llu %10llu %8.2f %-8s %-16s %9.1f %4d\n",
+	       case_names[bcase], size,
+	       cfg->namespaces, cfg->threads, n, failed,
+	       percentile(sorted, n, 0.50) / 1e3,
+	       percentile(sorted, n, 0.90) / 1e3,
+	       percentile(sorted, n, 0.99) / 1e3,
+	       percentile(sorted, n, 1.00) / 1e3, n / secs,
+	       (after.measurements - before.measurements) / secs,
+	       (unsigned long long) (after.hashes - before.hashes),
+	       (unsigned long long) (after.verity - before.verity),
+	       n ? (double) (after.calls - before.calls) / n : 0.0,
+	       cfg->algo ? cfg->algo : "default", driver, mbps,
+	       cfg->cpus ? cfg->cpus : cfg->nr_cpus);
+
+	if (cfg->csv) {
+		fprintf(cfg->csv, "%s,%zu,%d,%d,%zu,%zu,%llu,%llu,%llu,%llu,"
+			"%.0f,%.0f,%llu,%d,%llu,%.3f,%s,%s,%.1f,%d\n",
+			case_names[bcase], size,
+			cfg->namespaces, cfg->threads, n, failed,
+			(unsigned long long) percentile(sorted, n, 0.50),
+			(unsigned long long) percentile(sorted, n, 0.90),
+			(unsigned long long) percentile(sorted, n, 0.99),
+			(unsigned long long) percentile(sorted, n, 1.00),
+			n / secs,
+			(after.measurements - before.measurements) / secs,
+			(unsigned long long) (after.hashes - before.hashes),
+			cfg->verity,
+			(unsigned long long) (after.verity - before.verity),
+			n ? (double) (after.calls - before.calls) / n : 0.0,
+			cfg->algo ? cfg->algo : "default", driver, mbps,
+			cfg->cpus ? cfg->cpus : cfg->nr_cpus);
+		fflush(cfg->csv);
+	}
+
+	/* Concurrent mappers of one file wait for a single hash */
+	if (bcase == CASE_DEDUP && after.hashes - before.hashes != 1) {
+		fprintf(stderr, "dedup: %llu hashes of one file mapped by "
+			"%d namespaces x %d threads, expected 1\n",
+			(unsigned long long) (after.hashes - before.hashes),
+			cfg->namespaces, cfg->threads);
+		ret = -EPROTO;
+	}
+
+	/* Exec'd files are cached and shared like any other */
+	if (bcase == CASE_REEXEC && after.hashes - first.hashes != 1) {
+		fprintf(stderr, "reexec: %llu hashes of one binary exec'd "
+			"from %d namespaces, expected 1\n",
+			(unsigned long long) (after.hashes - first.hashes),
+			cfg->namespaces);
+		ret = -EPROTO;
+	}
+
+	free(sorted);
+	return ret;
+}
+
+static int parse_size(const char *str, size_t *size)
+{
+	char *end;
+	double value = strtod(str, &end);
+
+	switch (*end) {
+	case 'k': case 'K':
+		value *= 1024;
+		end++;
+		break;
+	case 'm': case 'M':
+		value *= 1024 * 1024;
+		end++;
+		break;
+	case 'g': case 'G':
+		value *= 1024 * 1024 * 1024;
+		end++;
+		break;
+	}
+
+	if (*end || value < 1)
+		return -EINVAL;
+	*size = (size_t) value;
+	return 0;
+}
+
+static int parse_sizes(struct bench_config *cfg, char *list)
+{
+	char *tok, *save;
+
+	cfg->nr_sizes = 0;
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (cfg->nr_sizes == MAX_SIZES ||
+		    parse_size(tok, &cfg->sizes[cfg->nr_sizes]))
+			return -EINVAL;
+		cfg->nr_sizes++;
+	}
+	return cfg->nr_sizes ? 0 : -EINVAL;
+}
+
+static int parse_cases(struct bench_config *cfg, char *list)
+{
+	char *tok, *save;
+	int i;
+
+	cfg->cases = 0;
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < CASE_MAX; i++)
+			if (!strcmp(tok, case_names[i]))
+				break;
+		if (i == CASE_MAX)
+			return -EINVAL;
+		cfg->cases |= 1u << i;
+	}
+	return cfg->cases ? 0 : -EINVAL;
+}
+
+static int parse_algos(struct bench_config *cfg, char *list)
+{
+	char *tok, *save;
+
+	cfg->nr_algos = 0;
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (cfg->nr_algos == MAX_ALGOS)
+			return -EINVAL;
+		cfg->algos[cfg->nr_algos++] = tok;
+	}
+	return cfg->nr_algos ? 0 : -EINVAL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -n, --namespaces N  UTS namespaces (processes), default 4\n"
+		"  -t, --threads M     threads per namespace, default 4\n"
+		"  -i, --iterations I  mappings (execs) per thread for "
+		"none/warm/exec/reexec, default 1000\n"
+		"  -f, --files F       files per thread for cold/shared/append, "
+		"default 32\n"
+		"  -s, --sizes LIST    file sizes, default 4k,64k,1m,16m\n"
+		"  -c, --cases LIST    none,cold,warm,shared,exec,dedup,reexec,"
+		"append (default all)\n"
+		"  -d, --dir DIR       file directory, default ./bench-data\n"
+		"  -p, --probe PATH    probe binary, default ./probe\n"
+		"  -o, --csv FILE      also append results as CSV\n"
+		"  -V, --verity        enable fs-verity on the files\n"
+		"  -a, --algos LIST    hash algorithms, e.g. sha256,sha512 "
+		"(default: module's)\n", prog);
+}
+
+static const struct option long_opts[] = {
+	{ "namespaces", required_argument, NULL, 'n' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "iterations", required_argument, NULL, 'i' },
+	{ "files", required_argument, NULL, 'f' },
+	{ "sizes", required_argument, NULL, 's' },
+	{ "cases", required_argument, NULL, 'c' },
+	{ "dir", required_argument, NULL, 'd' },
+	{ "probe", required_argument, NULL, 'p' },
+	{ "csv", required_argument, NULL, 'o' },
+	{ "verity", no_argument, NULL, 'V' },
+	{ "algos", required_argument, NULL, 'a' },
+	{ "help", no_argument, NULL, 'h' },
+	{ 0 },
+};
+
+int main(int argc, char **argv)
+{
+	char default_sizes[] = "4k,64k,1m,16m";
+	struct bench_config cfg = {
+		.namespaces = 4,
+		.threads = 4,
+		.iterations = 1000,
+		.files = 32,
+		.cases = (1u << CASE_MAX) - 1,
+		.dir = "./bench-data",
+		.probe = "./probe",
+	};
+	const char *csv = NULL;
+	size_t max_count;
+	int opt, s, c, a, cpus, batch, ret = 0;
+	FILE *f;
+
+	/* The exec case runs a copy of this binary */
+	if (argc > 1 && !strcmp(argv[1], EXEC_CHILD))
+		return 0;
+
+	parse_sizes(&cfg, default_sizes);
+
+	while ((opt = getopt_long(argc, argv, "n:t:i:f:s:c:d:p:o:Va:h",
+				  long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			cfg.namespaces = atoi(optarg);
+			break;
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		case 'i':
+			cfg.iterations = atoi(optarg);
+			break;
+		case 'f':
+			cfg.files = atoi(optarg);
+			break;
+		case 's':
+			if (parse_sizes(&cfg, optarg)) {
+				fprintf(stderr, "invalid size list\n");
+				return 1;
+			}
+			break;
+		case 'c':
+			if (parse_cases(&cfg, optarg)) {
+				fprintf(stderr, "invalid case list\n");
+				return 1;
+			}
+			break;
+		case 'd':
+			cfg.dir = optarg;
+			break;
+		case 'p':
+			cfg.probe = optarg;
+			break;
+		case 'o':
+			csv = optarg;
+			break;
+		case 'V':
+			cfg.verity = true;
+			break;
+		case 'a':
+			if (parse_algos(&cfg, optarg)) {
+				fprintf(stderr, "invalid algorithm list\n");
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (cfg.namespaces < 1 || cfg.threads < 1 || cfg.iterations < 1 ||
+	    cfg.files < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (sched_getaffinity(0, sizeof(cfg.cpuset), &cfg.cpuset)) {
+		perror("sched_getaffinity");
+		return 1;
+	}
+	cfg.nr_cpus = CPU_COUNT(&cfg.cpuset);
+
+	if (mkdir(cfg.dir, 0755) && errno != EEXIST) {
+		perror(cfg.dir);
+		return 1;
+	}
+
+	if (csv) {
+		cfg.csv = fopen(csv, "a");
+		if (!cfg.csv) {
+			perror(csv);
+			return 1;
+		}
+		if (!ftell(cfg.csv))
+			fprintf(cfg.csv, "case,size,namespaces,threads,mmaps,"
+				"failed,p50_ns,p90_ns,p99_ns,max_ns,"
+				"mmaps_per_sec,measurements_per_sec,"
+				"hashes,verity,verity_digests,calls_per_op,"
+				"algo,driver,hash_mb_per_sec,cpus\n");
+	}
+
+	max_count = cfg.iterations > cfg.files ? cfg.iterations : cfg.files;
+	shared = mmap(NULL, sizeof(*shared) + max_count * cfg.threads *
+		      cfg.namespaces * sizeof(uint64_t),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		      -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	ret = create_namespaces(&cfg);
+	if (ret) {
+		fprintf(stderr, "creating namespaces: %s (needs root)\n",
+			strerror(-ret));
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	printf("%-7s %10s %4s %4s %8s %6s %10s %10s %10s %10s %12s %12s "
+	       "%10s %10s %8s %-8s %-16s %9s %4s\n", "case", "size", "ns",
+	       "thr", "mmaps", "failed", "p50(us)", "p90(us)", "p99(us)",
+	       "max(us)", "mmaps/s", "meas/s", "hashes", "verity", "calls/op",
+	       "algo", "driver", "MB/s", "cpus");
+
+	/* Unbatched, every append waits for a TPM extend */
+	f = cfg.cases & (1u << CASE_APPEND) ? fopen(MODULE_TPM_BATCH, "r") :
+	      NULL;
+	if (f) {
+		if (fscanf(f, "%d", &batch) == 1 && !batch)
+			fprintf(stderr, "append: tpm_batch is 0, appends are "
+				"bound by the TPM\n");
+		fclose(f);
+	}
+
+	/* none runs first, before the probe is ever attached */
+	for (a = 0; a < (cfg.nr_algos ? cfg.nr_algos : 1) && !ret; a++) {
+		cfg.algo = cfg.nr_algos ? cfg.algos[a] : NULL;
+		for (c = 0; c < CASE_MAX && !ret; c++) {
+			if (!(cfg.cases & (1u << c)))
+				continue;
+			/* exec maps the benchmark binary, sizes do not apply */
+			if (c == CASE_EXEC || c == CASE_REEXEC) {
+				ret = run_case(&cfg, c, 0, (int) time(NULL),
+					       true);
+				continue;
+			}
+			/* append doubles the CPUs up to all of them */
+			if (c == CASE_APPEND) {
+				for (s = 0; s < cfg.nr_sizes && !ret; s++) {
+					cpus = 1;
+					do {
+						cfg.cpus = cpus;
+						ret = run_case(&cfg, c,
+							       cfg.sizes[s],
+							       (int) time(NULL) +
+							       cpus, true);
+						cpus = cpus * 2 < cfg.nr_cpus ?
+						       cpus * 2 : cfg.nr_cpus;
+					} while (!ret && cfg.cpus < cfg.nr_cpus);
+				}
+				cfg.cpus = 0;
+				continue;
+			}
+			for (s = 0; s < cfg.nr_sizes && !ret; s++)
+				ret = run_case(&cfg, c, cfg.sizes[s],
+					       (int) time(NULL), true);
+		}
+	}
+
+	/* Leave the namespaces to the module default again */
+	if (cfg.nr_algos && probe_pid) {
+		cfg.algo = NULL;
+		policy_apply(&cfg);
+	}
+
+	probe_stop();
+	if (cfg.csv)
+		fclose(cfg.csv);
+
+	if (ret)
+		fprintf(stderr, "benchmark failed: %s\n", strerror(-ret));
+	return ret ? 1 : 0;
+}
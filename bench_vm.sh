@@ -0,0 +1,140 @@
+#!/bin/sh
+#
+# bench_vm.sh
+# 	Run ima_bench unattended in a QEMU VM with a swtpm TPM 2.0
+#
+# Host:  KERNEL=bzImage ROOTFS=rootfs.img ./bench_vm.sh
+# 	Boots KERNEL on a snapshot of ROOTFS (raw ext4 image with
+# 	/bin/sh, insmod, mount, unshare, nsenter, awk and sha256sum,
+# 	busybox has them all). This directory is shared over 9p;
+# 	container_ima.ko, probe and ima_bench must be built for
+# 	KERNEL, make bench-vm KDIR=<KERNEL build tree> does that.
+# 	overlay_test.sh runs before the benchmark and vpcr_check.sh
+# 	after it; the first failure ends the run.
+# 	Results are appended to results/<kernel release>.csv and the
+# 	full log is kept in results/<kernel release>.log.
+#
+# Guest: bench_vm.sh --guest, started by the kernel as init
+#
+# Environment:
+# 	KERNEL		kernel image (required)
+# 	ROOTFS		root filesystem image (required)
+# 	CPUS		guest CPUs, default 4
+# 	MEMORY		guest memory, default 4G
+# 	TIMEOUT		seconds before the VM is killed, default 1800
+# 	BENCH_ARGS	extra ima_bench arguments
+# 	MODULE_ARGS	container_ima module parameters, default
+# 			tpm_batch=64 so vPCR entries reach the IMA list
+#
+# 	BENCH_ARGS and MODULE_ARGS reach the guest on the kernel
+# 	command line, so they cannot contain double quotes.
+#
+set -eu
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+TAG=bench
+GUEST_MNT=/mnt
+
+# Load the module, run the checks and the benchmark, stop at the
+# first failure
+run() {
+	echo "kernel $release"
+	cat /proc/cmdline
+	# shellcheck disable=SC2086
+	insmod ./container_ima.ko ${MODULE_ARGS-tpm_batch=64} || return
+	# Files live on the guest root filesystem: 9p has no
+	# i_version, so measurements would never be cached
+	DIR=/var/tmp/ima-overlay ./overlay_test.sh ./probe || return
+	# shellcheck disable=SC2086
+	./ima_bench -d /var/tmp/ima-bench -p ./probe \
+		-o "results/$release.csv" ${BENCH_ARGS:-} || return
+	./vpcr_check.sh
+}
+
+guest() {
+	mount -t proc proc /proc
+	mount -t sysfs sysfs /sys
+	mount -t debugfs debugfs /sys/kernel/debug
+	mount -t securityfs securityfs /sys/kernel/security
+	mount -t bpf bpf /sys/fs/bpf 2>/dev/null || true
+
+	cd "$GUEST_MNT"
+	release=$(uname -r)
+	mkdir -p results
+	log=results/$release.log
+
+	status=0
+	run >"$log" 2>&1 || status=$?
+	echo "status $status" >>"$log"
+
+	sync
+	echo o >/proc/sysrq-trigger
+	sleep 10
+}
+
+host() {
+	: "${KERNEL:?set KERNEL to a kernel image}"
+	: "${ROOTFS:?set ROOTFS to a root filesystem image}"
+
+	# The kernel hands unknown K=V parameters to init as environment
+	env=
+	case "${MODULE_ARGS-}${BENCH_ARGS-}" in
+	*\"*)
+		echo "MODULE_ARGS and BENCH_ARGS cannot contain double quotes" >&2
+		exit 1
+		;;
+	esac
+	[ -z "${MODULE_ARGS+set}" ] || env="MODULE_ARGS=\"$MODULE_ARGS\" "
+	[ -z "${BENCH_ARGS:-}" ] || env="${env}BENCH_ARGS=\"$BENCH_ARGS\" "
+
+	for tool in swtpm qemu-system-x86_64; do
+		command -v "$tool" >/dev/null || {
+			echo "$tool not found" >&2
+			exit 1
+		}
+	done
+
+	tpmdir=$(mktemp -d)
+	swtpm_pid=
+	trap 'kill "$swtpm_pid" 2>/dev/null || true; rm -rf "$tpmdir"' EXIT
+
+	swtpm socket --tpm2 --tpmstate dir="$tpmdir" \
+		--ctrl type=unixio,path="$tpmdir/swtpm-sock" &
+	swtpm_pid=$!
+	while [ ! -S "$tpmdir/swtpm-sock" ]; do
+		sleep 0.1
+	done
+
+	mkdir -p "$SRC/results"
+	start=$(date +%s)
+
+	timeout "${TIMEOUT:-1800}" qemu-system-x86_64 \
+		-machine q35,accel=kvm:tcg -cpu max \
+		-smp "${CPUS:-4}" -m "${MEMORY:-4G}" \
+		-nographic -no-reboot \
+		-kernel "$KERNEL" \
+		-drive file="$ROOTFS",if=virtio,format=raw,snapshot=on \
+		-virtfs local,path="$SRC",mount_tag=$TAG,security_model=none \
+		-chardev socket,id=chrtpm,path="$tpmdir/swtpm-sock" \
+		-tpmdev emulator,id=tpm0,chardev=chrtpm \
+		-device tpm-tis,tpmdev=tpm0 \
+		-append "console=ttyS0 root=/dev/vda rw panic=-1 ima_policy=tcb \
+${env}init=/bin/sh -- -c \"mount -t 9p -o trans=virtio $TAG $GUEST_MNT && \
+exec $GUEST_MNT/bench_vm.sh --guest\"" || true
+
+	# The newest log written during this boot carries the status
+	log=$(find "$SRC/results" -name '*.log' -newermt "@$start" | head -n 1)
+	if [ -z "$log" ]; then
+		echo "benchmark did not run" >&2
+		exit 1
+	fi
+
+	cat "$log"
+	grep -qx "status 0" "$log"
+}
+
+if [ "${1:-}" = "--guest" ]; then
+	guest
+else
+	host
+fi
@@ -40,162 +40,3046 @@
 #include <uapi/linux/btf.h>
 #include <uapi/linux/bpf.h>
 #include <linux/iversion.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/jhash.h>
+#include <linux/seq_file.h>
+#include <linux/fsverity.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
+#include <linux/random.h>
 #include "container_ima.h"
 
 #define MODULE_NAME "ContainerIMA"
 extern void security_task_getsecid(struct task_struct *p, u32 *secid);
 extern const int hash_digest_size[HASH_ALGO__LAST];
 
+static unsigned int measure_cache_max = 65536;
+module_param(measure_cache_max, uint, 0644);
+MODULE_PARM_DESC(measure_cache_max,
+		"Maximum (inode, namespace) pairs and inodes kept in the measurement cache");
+
+static bool policy_cache = true;
+module_param(policy_cache, bool, 0644);
+MODULE_PARM_DESC(policy_cache,
+		"Cache ima_get_action() decisions until the IMA or LSM policy changes");
+
+static unsigned int policy_cache_max = 4096;
+module_param(policy_cache_max, uint, 0644);
+MODULE_PARM_DESC(policy_cache_max,
+		"Maximum cached policy decisions");
+
+static unsigned int tpm_batch;
+module_param(tpm_batch, uint, 0644);
+MODULE_PARM_DESC(tpm_batch,
+		"Measurements per namespace log before an aggregate TPM extend, 0 extends every measurement");
+
+static unsigned int tpm_interval_ms = 1000;
+module_param(tpm_interval_ms, uint, 0644);
+MODULE_PARM_DESC(tpm_interval_ms,
+		"Maximum delay in ms before pending vPCRs are extended into the TPM");
+
+static bool stats = true;
+module_param(stats, bool, 0644);
+MODULE_PARM_DESC(stats,
+		"Record per-stage latency histograms in debugfs container_ima/stats");
+
+static bool reuse_iint = true;
+module_param(reuse_iint, bool, 0644);
+MODULE_PARM_DESC(reuse_iint,
+		"Reuse the file digest host IMA collected at the same i_version instead of hashing");
+
+static bool verity = true;
+module_param(verity, bool, 0644);
+MODULE_PARM_DESC(verity,
+		"Measure the fs-verity digest of verity files instead of hashing them");
+
+static char *verity_template = "ima-ngv2";
+module_param(verity_template, charp, 0444);
+MODULE_PARM_DESC(verity_template,
+		"IMA template of fs-verity measurements, its d-ngv2 field tags them as verity");
+
+static char *hash_algo;
+module_param(hash_algo, charp, 0444);
+MODULE_PARM_DESC(hash_algo,
+		"File hash algorithm of container measurements, IMA's when unset");
+
+static unsigned long ahash_minsize = 1024 * 1024;
+module_param(ahash_minsize, ulong, 0644);
+MODULE_PARM_DESC(ahash_minsize,
+		"Minimum file size hashed with chunked async ahash, 0 disables");
+
+static char *hash_algos;
+module_param(hash_algos, charp, 0444);
+MODULE_PARM_DESC(hash_algos,
+		"Comma separated file digest algorithms computed in the same pass as the measured one");
+
+static bool async_mode;
+module_param(async_mode, bool, 0644);
+MODULE_PARM_DESC(async_mode,
+		"Hash and store measurements from a worker pool instead of the mmap hook");
+
+static unsigned int async_queue_depth = 64;
+module_param(async_queue_depth, uint, 0644);
+MODULE_PARM_DESC(async_queue_depth,
+		"Maximum pending asynchronous measurements per CPU");
+
+static unsigned int async_overflow = IMA_ASYNC_OVERFLOW_SYNC;
+module_param(async_overflow, uint, 0644);
+MODULE_PARM_DESC(async_overflow,
+		"Full queue behavior: 0 measure synchronously, 1 drop and count");
+
+/*
+ * Per-stage statistics
+ * 	Per-CPU log2 latency histograms and hit/miss/error counters
+ * 	for each stage of a measurement. Bucket b counts durations
+ * 	in [2^(b-1), 2^b) ns. Updates are a this_cpu increment, so
+ * 	they can stay enabled in production.
+ */
+static DEFINE_PER_CPU(struct ima_stage_stats [IMA_STAGE_MAX], ima_stats);
+
+static const char * const ima_stage_names[IMA_STAGE_MAX] = {
+	[IMA_STAGE_MMAP]		= "mmap",
+	[IMA_STAGE_GET_ACTION]		= "get_action",
+	[IMA_STAGE_MEASURE]		= "measure",
+	[IMA_STAGE_FILE_HASH]		= "file_hash",
+	[IMA_STAGE_D_PATH]		= "d_path",
+	[IMA_STAGE_BUFFER_HASH]		= "buffer_hash",
+	[IMA_STAGE_ALLOC_TEMPLATE]	= "alloc_template",
+	[IMA_STAGE_STORE_TEMPLATE]	= "store_template",
+};
+
+static inline u64 ima_stage_start(void)
+{
+	return stats ? ktime_get_ns() : 0;
+}
+
+/*
+ * ima_stage_end
+ * 	int stage: enum ima_stage
+ * 	u64 start: value of ima_stage_start
+ * 	int result: negative if the stage failed
+ */
+static void ima_stage_end(int stage, u64 start, int result)
+{
+	unsigned int bucket;
+
+	if (!start)
+		return;
+
+	bucket = min_t(unsigned int, fls64(ktime_get_ns() - start), 
+			IMA_HIST_BUCKETS - 1);
+	this_cpu_inc(ima_stats[stage].hist[bucket]);
+	if (result < 0)
+		this_cpu_inc(ima_stats[stage].errors);
+}
+
+static inline void ima_stage_hit(int stage, bool hit)
+{
+	if (!stats)
+		return;
+	if (hit)
+		this_cpu_inc(ima_stats[stage].hits);
+	else
+		this_cpu_inc(ima_stats[stage].misses);
+}
+
+/*
+ * debugfs container_ima/stats
+ * 	One line per stage, summed over CPUs:
+ * 	stage hits misses errors bucket0 ... bucket31
+ */
+static int ima_stats_show(struct seq_file *m, void *v)
+{
+	struct ima_stage_stats sum;
+	int stage, cpu, i;
+
+	for (stage = 0; stage < IMA_STAGE_MAX; stage++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			struct ima_stage_stats *st = 
+				&per_cpu(ima_stats, cpu)[stage];
+
+			sum.hits += st->hits;
+			sum.misses += st->misses;
+			sum.errors += st->errors;
+			for (i = 0; i < IMA_HIST_BUCKETS; i++)
+				sum.hist[i] += st->hist[i];
+		}
+
+		seq_printf(m, "%s %llu %llu %llu", ima_stage_names[stage], 
+				sum.hits, sum.misses, sum.errors);
+		for (i = 0; i < IMA_HIST_BUCKETS; i++)
+			seq_printf(m, " %llu", sum.hist[i]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(ima_stats);
+
+/*
+ * Slab caches
+ * 	Objects allocated on every new measurement come from their
+ * 	own caches rather than the kmalloc size classes. Records are
+ * 	sized for the hash_algos digests, fixed once the module is
+ * 	loaded. RCU-freed objects go back through call_rcu, so the
+ * 	rcu_barrier at exit covers them before the caches are
+ * 	destroyed.
+ */
+static struct kmem_cache *ima_icache_cachep;
+static struct kmem_cache *ima_ns_cache_cachep;
+static struct kmem_cache *ima_digest_cachep;
+static struct kmem_cache *ima_record_cachep;
+
+static void ima_icache_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(ima_icache_cachep, 
+			container_of(head, struct ima_inode_cache, rcu));
+}
+
+static void ima_ns_cache_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(ima_ns_cache_cachep, 
+			container_of(head, struct ima_ns_cache, rcu));
+}
+
+static void ima_digest_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(ima_digest_cachep, 
+			container_of(head, struct ima_cached_digest, rcu));
+}
+
+static void ima_slab_exit(void)
+{
+	kmem_cache_destroy(ima_record_cachep);
+	kmem_cache_destroy(ima_digest_cachep);
+	kmem_cache_destroy(ima_ns_cache_cachep);
+	kmem_cache_destroy(ima_icache_cachep);
+}
+
+/* nr_files: hash_algos digests per record */
+static int ima_slab_init(int nr_files)
+{
+	ima_icache_cachep = KMEM_CACHE(ima_inode_cache, 0);
+	ima_ns_cache_cachep = KMEM_CACHE(ima_ns_cache, 0);
+	ima_digest_cachep = KMEM_CACHE(ima_cached_digest, 0);
+	ima_record_cachep = kmem_cache_create("ima_ns_record", 
+			sizeof(struct ima_ns_record) + 
+			nr_files * sizeof(struct ima_digest_ref *), 
+			__alignof__(struct ima_ns_record), 0, NULL);
+	if (!ima_icache_cachep || !ima_ns_cache_cachep || 
+			!ima_digest_cachep || !ima_record_cachep) {
+		ima_slab_exit();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Measurement cache
+ * 	ima_ns_htable answers "was this inode already measured for
+ * 	this namespace at its current i_version" without touching
+ * 	the file. ima_inode_htable holds the per-inode state: the
+ * 	namespace entries and the file digests shared by all
+ * 	namespaces. A write (i_version change) or an inode eviction
+ * 	drops all of it at once. Readers use RCU, writers take
+ * 	ima_cache_lock.
+ */
+static DEFINE_HASHTABLE(ima_inode_htable, IMA_CACHE_BITS);
+static DEFINE_HASHTABLE(ima_ns_htable, IMA_CACHE_BITS);
+static DEFINE_SPINLOCK(ima_cache_lock);
+static atomic_t ima_cache_entries = ATOMIC_INIT(0);
+static atomic_t ima_cache_inodes = ATOMIC_INIT(0);
+
+static inline unsigned long ima_ns_cache_key(struct inode *inode, 
+		unsigned int ns, int algo)
+{
+	return (unsigned long) inode ^ ns ^ algo;
+}
+
+static struct ima_inode_cache *__ima_inode_cache_find(struct inode *inode)
+{
+	struct ima_inode_cache *icache;
+
+	hash_for_each_possible_rcu(ima_inode_htable, icache, hnode, 
+			(unsigned long) inode) {
+		if (icache->inode == inode)
+			return icache;
+	}
+	return NULL;
+}
+
+/* Caller holds ima_cache_lock */
+static void __ima_inode_cache_drop(struct ima_inode_cache *icache)
+{
+	struct ima_ns_cache *entry;
+	struct ima_cached_digest *digest, *dtmp;
+	struct hlist_node *tmp;
+
+	hlist_for_each_entry_safe(entry, tmp, &icache->ns_entries, 
+			inode_node) {
+		hash_del_rcu(&entry->hnode);
+		hlist_del(&entry->inode_node);
+		atomic_dec(&ima_cache_entries);
+		call_rcu(&entry->rcu, ima_ns_cache_free_rcu);
+	}
+	list_for_each_entry_safe(digest, dtmp, &icache->digests, list) {
+		list_del_rcu(&digest->list);
+		call_rcu(&digest->rcu, ima_digest_free_rcu);
+	}
+	hash_del_rcu(&icache->hnode);
+	atomic_dec(&ima_cache_inodes);
+	call_rcu(&icache->rcu, ima_icache_free_rcu);
+}
+
+/*
+ * __ima_inode_cache_get
+ * 	struct inode *inode: inode measured
+ * 	u64 version: i_version sampled before the file was hashed
+ * 	struct ima_inode_cache **new: preallocated node, consumed
+ * 	if used
+ *
+ * 	Find or create the state for inode at version, replacing a
+ * 	stale one. Caller holds ima_cache_lock.
+ */
+static struct ima_inode_cache *__ima_inode_cache_get(struct inode *inode,
+		u64 version, struct ima_inode_cache **new)
+{
+	struct ima_inode_cache *icache;
+
+	icache = __ima_inode_cache_find(inode);
+	if (icache && icache->version == version)
+		return icache;
+	if (icache)
+		__ima_inode_cache_drop(icache);
+
+	icache = *new;
+	*new = NULL;
+	icache->inode = inode;
+	icache->version = version;
+	INIT_HLIST_HEAD(&icache->ns_entries);
+	INIT_LIST_HEAD(&icache->digests);
+	hash_add_rcu(ima_inode_htable, &icache->hnode, 
+			(unsigned long) inode);
+	atomic_inc(&ima_cache_inodes);
+
+	return icache;
+}
+
+/*
+ * ima_cache_usable
+ * 	struct inode *inode: inode being measured
+ *
+ * 	The cache is only trusted when i_version tracks content
+ * 	changes and nobody holds it open for write. A negative
+ * 	i_writecount is deny_write_access(), held by an exec of the
+ * 	file: no writer can exist then, as in inode_version() of
+ * 	probe.bpf.c.
+ */
+static bool ima_cache_usable(struct inode *inode)
+{
+	return IS_I_VERSION(inode) && atomic_read(&inode->i_writecount) <= 0;
+}
+
+/*
+ * ima_cache_lookup
+ * 	struct inode *inode: inode being measured
+ * 	unsigned int ns: namespace 
+ * 	int algo: hash algorithm requested for ns
+ *
+ * 	Returns true if inode was already measured for ns with algo
+ * 	and has not changed since. A container whose policy switches
+ * 	algorithms gets a new measurement of every file.
+ */
+static bool ima_cache_lookup(struct inode *inode, unsigned int ns, int algo)
+{
+	struct ima_ns_cache *entry;
+	bool hit = false;
+
+	if (!ima_cache_usable(inode))
+		return false;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(ima_ns_htable, entry, hnode, 
+			ima_ns_cache_key(inode, ns, algo)) {
+		if (entry->ns != ns || entry->algo != algo ||
+				entry->icache->inode != inode)
+			continue;
+		hit = inode_eq_iversion(inode, entry->icache->version);
+		break;
+	}
+	rcu_read_unlock();
+
+	return hit;
+}
+
+/*
+ * ima_cache_insert
+ * 	struct inode *inode: inode measured
+ * 	u64 version: i_version sampled before the file was hashed
+ * 	unsigned int ns: namespace 
+ * 	int algo: hash algorithm requested for ns
+ *
+ * 	Record a successful measurement. A stale inode entry (older
+ * 	i_version) is replaced together with all its namespaces.
+ */
+static void ima_cache_insert(struct inode *inode, u64 version, 
+		unsigned int ns, int algo)
+{
+	struct ima_inode_cache *icache, *new_icache;
+	struct ima_ns_cache *entry, *cur;
+
+	if (!ima_cache_usable(inode))
+		return;
+	if (atomic_read(&ima_cache_entries) >= measure_cache_max)
+		return;
+
+	new_icache = kmem_cache_zalloc(ima_icache_cachep, GFP_KERNEL);
+	entry = kmem_cache_zalloc(ima_ns_cache_cachep, GFP_KERNEL);
+	if (!new_icache || !entry)
+		goto out;
+
+	spin_lock(&ima_cache_lock);
+	icache = __ima_inode_cache_get(inode, version, &new_icache);
+	hlist_for_each_entry(cur, &icache->ns_entries, inode_node) {
+		if (cur->ns == ns && cur->algo == algo)
+			goto unlock;
+	}
+
+	entry->ns = ns;
+	entry->algo = algo;
+	entry->icache = icache;
+	hlist_add_head(&entry->inode_node, &icache->ns_entries);
+	hash_add_rcu(ima_ns_htable, &entry->hnode, 
+			ima_ns_cache_key(inode, ns, algo));
+	atomic_inc(&ima_cache_entries);
+	entry = NULL;
+unlock:
+	spin_unlock(&ima_cache_lock);
+out:
+	if (new_icache)
+		kmem_cache_free(ima_icache_cachep, new_icache);
+	if (entry)
+		kmem_cache_free(ima_ns_cache_cachep, entry);
+}
+
+/*
+ * ima_digest_lookup
+ * 	struct inode *inode: inode being measured
+ * 	int hash_algo: algorithm of the wanted digest
+ * 	struct ima_max_digest_data *hash: file digest (out)
+ *
+ * 	Returns true if a digest of the current inode version was
+ * 	already computed, for any namespace
+ */
+static bool ima_digest_lookup(struct inode *inode, int hash_algo, 
+		struct ima_max_digest_data *hash)
+{
+	struct ima_inode_cache *icache;
+	struct ima_cached_digest *digest;
+	bool hit = false;
+
+	if (!ima_cache_usable(inode))
+		return false;
+
+	rcu_read_lock();
+	icache = __ima_inode_cache_find(inode);
+	if (!icache || !inode_eq_iversion(inode, icache->version))
+		goto out;
+
+	list_for_each_entry_rcu(digest, &icache->digests, list) {
+		if (digest->algo != hash_algo)
+			continue;
+		hash->hdr.algo = digest->algo;
+		hash->hdr.length = digest->length;
+		memcpy(hash->digest, digest->digest, digest->length);
+		hit = true;
+		break;
+	}
+out:
+	rcu_read_unlock();
+
+	return hit;
+}
+
+/*
+ * ima_digest_insert
+ * 	struct inode *inode: inode hashed
+ * 	u64 version: i_version sampled before the file was hashed
+ * 	struct ima_digest_data *hash: file digest
+ *
+ * 	Share a file digest with later measurements of the same
+ * 	inode version from any namespace
+ */
+static void ima_digest_insert(struct inode *inode, u64 version, 
+		struct ima_digest_data *hash)
+{
+	struct ima_inode_cache *icache, *new_icache;
+	struct ima_cached_digest *digest, *cur;
+
+	if (!ima_cache_usable(inode))
+		return;
+	if (atomic_read(&ima_cache_inodes) >= measure_cache_max)
+		return;
+
+	new_icache = kmem_cache_zalloc(ima_icache_cachep, GFP_KERNEL);
+	digest = kmem_cache_zalloc(ima_digest_cachep, GFP_KERNEL);
+	if (!new_icache || !digest)
+		goto out;
+
+	digest->algo = hash->algo;
+	digest->length = hash->length;
+	memcpy(digest->digest, hash->digest, hash->length);
+
+	spin_lock(&ima_cache_lock);
+	icache = __ima_inode_cache_get(inode, version, &new_icache);
+	list_for_each_entry(cur, &icache->digests, list) {
+		if (cur->algo == digest->algo)
+			goto unlock;
+	}
+	list_add_tail_rcu(&digest->list, &icache->digests);
+	digest = NULL;
+unlock:
+	spin_unlock(&ima_cache_lock);
+out:
+	if (new_icache)
+		kmem_cache_free(ima_icache_cachep, new_icache);
+	if (digest)
+		kmem_cache_free(ima_digest_cachep, digest);
+}
+
+/*
+ * ima_inode_free_handler
+ * 	Pre-handler for security_inode_free(), drops cached state
+ * 	before the inode (and its address) can be reused
+ */
+static int ima_inode_free_handler(struct kprobe *p, struct pt_regs *regs)
+{
+	struct inode *inode = (struct inode *) regs_get_kernel_argument(regs, 0);
+	struct ima_inode_cache *icache;
+
+	if (!atomic_read(&ima_cache_inodes))
+		return 0;
+
+	spin_lock(&ima_cache_lock);
+	icache = __ima_inode_cache_find(inode);
+	if (icache)
+		__ima_inode_cache_drop(icache);
+	spin_unlock(&ima_cache_lock);
+
+	return 0;
+}
+
+static struct kprobe inode_free_kp = {
+	.symbol_name = "security_inode_free",
+	.pre_handler = ima_inode_free_handler,
+};
+
+static void ima_cache_flush(void)
+{
+	struct ima_inode_cache *icache;
+	struct hlist_node *tmp;
+	int bkt;
+
+	spin_lock(&ima_cache_lock);
+	hash_for_each_safe(ima_inode_htable, bkt, tmp, icache, hnode)
+		__ima_inode_cache_drop(icache);
+	spin_unlock(&ima_cache_lock);
+}
+
+static void ima_free_entry(struct ima_template_entry *entry)
+{
+	int i;
+
+	for (i = 0; i < entry->template_desc->num_fields; i++)
+		kfree(entry->template_data[i].data);
+
+	kfree(entry->digests);
+	kfree(entry);
+}
+
+/*
+ * Hash transforms
+ * 	One shash and one ahash transform per algorithm, allocated on
+ * 	first use and kept until the module is unloaded. Readers
+ * 	that cannot sleep only use transforms already allocated.
+ */
+static struct crypto_shash *ima_tfms[HASH_ALGO__LAST];
+static struct crypto_ahash *ima_atfms[HASH_ALGO__LAST];
+static DEFINE_MUTEX(ima_tfms_lock);
+
+static struct crypto_shash *ima_shash_tfm(int algo)
+{
+	struct crypto_shash *tfm;
+
+	tfm = smp_load_acquire(&ima_tfms[algo]);
+	if (tfm)
+		return tfm;
+
+	mutex_lock(&ima_tfms_lock);
+	tfm = ima_tfms[algo];
+	if (!tfm) {
+		tfm = crypto_alloc_shash(hash_algo_name[algo], 0, 0);
+		if (!IS_ERR(tfm))
+			smp_store_release(&ima_tfms[algo], tfm);
+	}
+	mutex_unlock(&ima_tfms_lock);
+
+	return tfm;
+}
+
+static struct crypto_ahash *ima_ahash_tfm(int algo)
+{
+	struct crypto_ahash *tfm;
+
+	tfm = smp_load_acquire(&ima_atfms[algo]);
+	if (tfm)
+		return tfm;
+
+	mutex_lock(&ima_tfms_lock);
+	tfm = ima_atfms[algo];
+	if (!tfm) {
+		tfm = crypto_alloc_ahash(hash_algo_name[algo], 0, 0);
+		if (!IS_ERR(tfm))
+			smp_store_release(&ima_atfms[algo], tfm);
+	}
+	mutex_unlock(&ima_tfms_lock);
+
+	return tfm;
+}
+
+/*
+ * Digest and path interning
+ * 	Thousands of containers map the same shared libraries, so
+ * 	namespace records do not carry their own copies of file
+ * 	digests and paths. They point at refcounted entries of two
+ * 	rhashtables: file digests keyed by algorithm and value, and
+ * 	paths without the ns: prefix. A record is then fixed-size
+ * 	and its namespaced digest is recomputed when it is read,
+ * 	see ima_record_digest. Lookups use RCU, inserts and final
+ * 	puts take ima_intern_lock, so every entry found in a table
+ * 	under the lock still holds a reference.
+ */
+static struct rhashtable ima_digest_table;
+static struct rhashtable ima_path_table;
+static DEFINE_SPINLOCK(ima_intern_lock);
+static atomic_t ima_interned_digests = ATOMIC_INIT(0);
+static atomic_t ima_interned_paths = ATOMIC_INIT(0);
+static atomic_long_t ima_interned_path_bytes = ATOMIC_LONG_INIT(0);
+
+static const struct rhashtable_params ima_digest_params = {
+	.head_offset = offsetof(struct ima_digest_ref, node),
+	.key_offset = offsetof(struct ima_digest_ref, key),
+	.key_len = sizeof(struct ima_digest_key),
+	.automatic_shrinking = true,
+};
+
+static u32 ima_path_hashfn(const void *data, u32 len, u32 seed)
+{
+	const struct ima_path_key *key = data;
+
+	return jhash(key->path, key->len, seed);
+}
+
+static u32 ima_path_obj_hashfn(const void *data, u32 len, u32 seed)
+{
+	const struct ima_path_ref *ref = data;
+
+	return jhash(ref->path, ref->len, seed);
+}
+
+static int ima_path_obj_cmpfn(struct rhashtable_compare_arg *arg, 
+		const void *obj)
+{
+	const struct ima_path_key *key = arg->key;
+	const struct ima_path_ref *ref = obj;
+
+	return key->len != ref->len || memcmp(key->path, ref->path, key->len);
+}
+
+static const struct rhashtable_params ima_path_params = {
+	.head_offset = offsetof(struct ima_path_ref, node),
+	.hashfn = ima_path_hashfn,
+	.obj_hashfn = ima_path_obj_hashfn,
+	.obj_cmpfn = ima_path_obj_cmpfn,
+	.automatic_shrinking = true,
+};
+
+/*
+ * ima_digest_intern
+ * 	struct ima_digest_data *hash: file digest
+ *
+ * 	Returns a reference to the shared copy of hash, NULL if it
+ * 	could not be allocated
+ */
+static struct ima_digest_ref *ima_digest_intern(struct ima_digest_data *hash)
+{
+	struct ima_digest_ref *ref, *new_ref;
+	struct ima_digest_key key = { .algo = hash->algo, 
+				      .length = hash->length };
+
+	memcpy(key.digest, hash->digest, hash->length);
+
+	rcu_read_lock();
+	ref = rhashtable_lookup(&ima_digest_table, &key, ima_digest_params);
+	if (ref && !refcount_inc_not_zero(&ref->ref))
+		ref = NULL;
+	rcu_read_unlock();
+	if (ref)
+		return ref;
+
+	new_ref = kmalloc(sizeof(*new_ref), GFP_KERNEL);
+	if (!new_ref)
+		return NULL;
+	refcount_set(&new_ref->ref, 1);
+	new_ref->key = key;
+
+	spin_lock(&ima_intern_lock);
+	ref = rhashtable_lookup_get_insert_fast(&ima_digest_table, 
+			&new_ref->node, ima_digest_params);
+	if (!ref) {
+		ref = new_ref;
+		new_ref = NULL;
+		atomic_inc(&ima_interned_digests);
+	} else if (!IS_ERR(ref)) {
+		refcount_inc(&ref->ref);
+	}
+	spin_unlock(&ima_intern_lock);
+
+	kfree(new_ref);
+	return IS_ERR(ref) ? NULL : ref;
+}
+
+static void ima_digest_put(struct ima_digest_ref *ref)
+{
+	if (!refcount_dec_and_lock(&ref->ref, &ima_intern_lock))
+		return;
+	rhashtable_remove_fast(&ima_digest_table, &ref->node, 
+			ima_digest_params);
+	spin_unlock(&ima_intern_lock);
+
+	atomic_dec(&ima_interned_digests);
+	kfree_rcu(ref, rcu);
+}
+
+/*
+ * ima_path_intern
+ * 	const char *path: file path, without the ns: prefix
+ *
+ * 	Returns a reference to the shared copy of path, NULL if it
+ * 	could not be allocated
+ */
+static struct ima_path_ref *ima_path_intern(const char *path)
+{
+	struct ima_path_ref *ref, *new_ref;
+	struct ima_path_key key = { .path = path, .len = strlen(path) };
+
+	rcu_read_lock();
+	ref = rhashtable_lookup(&ima_path_table, &key, ima_path_params);
+	if (ref && !refcount_inc_not_zero(&ref->ref))
+		ref = NULL;
+	rcu_read_unlock();
+	if (ref)
+		return ref;
+
+	new_ref = kmalloc(struct_size(new_ref, path, key.len + 1), 
+			GFP_KERNEL);
+	if (!new_ref)
+		return NULL;
+	refcount_set(&new_ref->ref, 1);
+	new_ref->len = key.len;
+	memcpy(new_ref->path, path, key.len + 1);
+
+	spin_lock(&ima_intern_lock);
+	ref = rhashtable_lookup_get_insert_key(&ima_path_table, &key, 
+			&new_ref->node, ima_path_params);
+	if (!ref) {
+		ref = new_ref;
+		new_ref = NULL;
+		atomic_inc(&ima_interned_paths);
+		atomic_long_add(struct_size(ref, path, ref->len + 1), 
+				&ima_interned_path_bytes);
+	} else if (!IS_ERR(ref)) {
+		refcount_inc(&ref->ref);
+	}
+	spin_unlock(&ima_intern_lock);
+
+	kfree(new_ref);
+	return IS_ERR(ref) ? NULL : ref;
+}
+
+static void ima_path_put(struct ima_path_ref *ref)
+{
+	if (!refcount_dec_and_lock(&ref->ref, &ima_intern_lock))
+		return;
+	rhashtable_remove_fast(&ima_path_table, &ref->node, ima_path_params);
+	spin_unlock(&ima_intern_lock);
+
+	atomic_dec(&ima_interned_paths);
+	atomic_long_sub(struct_size(ref, path, ref->len + 1), 
+			&ima_interned_path_bytes);
+	kfree_rcu(ref, rcu);
+}
+
+/*
+ * ima_ns_buf
+ * 	const u8 *digest: file digest
+ * 	int length: digest size
+ * 	unsigned int ns: namespace 
+ * 	u8 *buf: HASH_MAX_DIGESTSIZE + 16 bytes (out)
+ *
+ * 	Returns the length of measurement || NS, NS in decimal
+ */
+static int ima_ns_buf(const u8 *digest, int length, unsigned int ns, 
+		u8 *buf)
+{
+	memcpy(buf, digest, length);
+
+	return length + scnprintf(buf + length, 
+			HASH_MAX_DIGESTSIZE + 16 - length, "%u", ns);
+}
+
+/*
+ * ima_record_digest
+ * 	struct ima_ns_record *record: namespace record
+ * 	unsigned int ns: namespace 
+ * 	u8 *out: namespaced measurement
+ *
+ * 	Recompute HASH(measurement || NS) from the interned file
+ * 	digest. The transform was allocated when the record was
+ * 	made and shash does not sleep, so this runs under the
+ * 	namespace lock.
+ */
+static int ima_record_digest(struct ima_ns_record *record, unsigned int ns, 
+		u8 *out)
+{
+	struct ima_digest_key *key = &record->digest->key;
+	struct crypto_shash *tfm;
+	u8 buf[HASH_MAX_DIGESTSIZE + 16];
+	int len;
+
+	if (record->namespaced) {
+		memcpy(out, key->digest, key->length);
+		return 0;
+	}
+
+	tfm = smp_load_acquire(&ima_tfms[key->algo]);
+	if (!tfm)
+		return -ENOENT;
+
+	len = ima_ns_buf(key->digest, key->length, ns, buf);
+	return crypto_shash_tfm_digest(tfm, buf, len, out);
+}
+
+static void ima_record_free(struct ima_ns_record *record)
+{
+	int i;
+
+	for (i = 0; i < record->nr_files; i++)
+		ima_digest_put(record->files[i]);
+	if (record->digest)
+		ima_digest_put(record->digest);
+	if (record->path)
+		ima_path_put(record->path);
+	kmem_cache_free(ima_record_cachep, record);
+}
+
+static int ima_intern_init(void)
+{
+	int ret;
+
+	ret = rhashtable_init(&ima_digest_table, &ima_digest_params);
+	if (ret < 0)
+		return ret;
+
+	ret = rhashtable_init(&ima_path_table, &ima_path_params);
+	if (ret < 0)
+		rhashtable_destroy(&ima_digest_table);
+
+	return ret;
+}
+
+/* Records are freed, both tables are empty */
+static void ima_intern_exit(void)
+{
+	rhashtable_destroy(&ima_path_table);
+	rhashtable_destroy(&ima_digest_table);
+}
+
+/*
+ * Per-namespace virtual PCRs
+ * 	Every namespace keeps its own log of measurements and a
+ * 	SHA-256 vPCR, extended in memory with the template digest
+ * 	of each record. Measurements are appended lock-free to a
+ * 	per-namespace llist and folded into the log by the periodic
+ * 	flush or a reader, so concurrent container starts never
+ * 	share a lock on the hot path:
+ * 		vPCR = SHA256(vPCR || SHA256(template data))
+ * 	Template data is hashed the ima-ng way, each field prefixed
+ * 	by its length. With tpm_batch set, per-file entries stay in
+ * 	the namespace log and the hardware PCR only receives one
+ * 	"NS:container-ima-vpcr" entry per dirty namespace, after
+ * 	tpm_batch measurements of a namespace or tpm_interval_ms.
+ * 	The count sits next to the llist head every append to the
+ * 	namespace already writes.
+ */
+static DEFINE_HASHTABLE(ima_namespace_htable, IMA_NAMESPACE_BITS);
+static DEFINE_SPINLOCK(ima_namespace_lock);
+static struct crypto_shash *ima_vpcr_tfm;
+static struct delayed_work ima_vpcr_work;
+static struct workqueue_struct *ima_async_wq;
+/* Namespace logs and vPCRs start over with every module load */
+static u64 ima_epoch;
+
+static struct ima_namespace *ima_namespace_find(unsigned int ns)
+{
+	struct ima_namespace *nsd;
+
+	hash_for_each_possible_rcu(ima_namespace_htable, nsd, hnode, ns) {
+		if (nsd->ns == ns)
+			return nsd;
+	}
+	return NULL;
+}
+
+/* Namespace state lives until the module is unloaded */
+static struct ima_namespace *ima_namespace_get(unsigned int ns)
+{
+	struct ima_namespace *nsd, *new_nsd;
+
+	rcu_read_lock();
+	nsd = ima_namespace_find(ns);
+	rcu_read_unlock();
+	if (nsd)
+		return nsd;
+
+	new_nsd = kzalloc(sizeof(*new_nsd), GFP_KERNEL);
+	if (!new_nsd)
+		return NULL;
+	new_nsd->ns = ns;
+	spin_lock_init(&new_nsd->lock);
+	init_llist_head(&new_nsd->incoming);
+	INIT_LIST_HEAD(&new_nsd->records);
+
+	spin_lock(&ima_namespace_lock);
+	nsd = ima_namespace_find(ns);
+	if (!nsd) {
+		hash_add_rcu(ima_namespace_htable, &new_nsd->hnode, ns);
+		nsd = new_nsd;
+		new_nsd = NULL;
+	}
+	spin_unlock(&ima_namespace_lock);
+
+	kfree(new_nsd);
+	return nsd;
+}
+
+/*
+ * ima_template_digest
+ * 	struct ima_template_entry *entry: initialized template
+ * 	u8 *digest: SHA-256 of the template data (out)
+ */
+static int ima_template_digest(struct ima_template_entry *entry, u8 *digest)
+{
+	SHASH_DESC_ON_STACK(shash, ima_vpcr_tfm);
+	int i, check;
+
+	shash->tfm = ima_vpcr_tfm;
+	check = crypto_shash_init(shash);
+	if (check < 0)
+		return check;
+
+	for (i = 0; i < entry->template_desc->num_fields; i++) {
+		u32 len = entry->template_data[i].len;
+
+		crypto_shash_update(shash, (u8 *) &len, sizeof(len));
+		crypto_shash_update(shash, entry->template_data[i].data, len);
+	}
+
+	return crypto_shash_final(shash, digest);
+}
+
+/* Caller holds the namespace lock */
+static int ima_vpcr_extend(u8 *vpcr, const u8 *digest)
+{
+	SHASH_DESC_ON_STACK(shash, ima_vpcr_tfm);
+	int check;
+
+	shash->tfm = ima_vpcr_tfm;
+	check = crypto_shash_init(shash);
+	if (check < 0)
+		return check;
+	crypto_shash_update(shash, vpcr, SHA256_DIGEST_SIZE);
+	crypto_shash_update(shash, digest, SHA256_DIGEST_SIZE);
+
+	return crypto_shash_final(shash, vpcr);
+}
+
+/*
+ * ima_ns_record
+ * 	unsigned int ns: namespace 
+ * 	struct ima_template_entry *entry: initialized template
+ * 	struct ima_digest_data *hash: namespaced measurement
+ * 	struct ima_digest_data *digest: file digest, or NULL
+ * 	const char *filename: name of measured file (ns:file path)
+ * 	bool verity: hash is derived from the fs-verity digest
+ * 	struct ima_file_digests *files: hash_algos file digests, or NULL
+ *
+ * 	Append a measurement to the namespace log, its vPCR is
+ * 	extended when the record is drained. The record shares the
+ * 	file digest and path with other namespaces and keeps hash
+ * 	itself only when digest is not known.
+ */
+static int ima_ns_record(unsigned int ns, struct ima_template_entry *entry, 
+		struct ima_digest_data *hash, struct ima_digest_data *digest, 
+		const char *filename, bool verity, 
+		struct ima_file_digests *files)
+{
+	struct ima_namespace *nsd;
+	struct ima_ns_record *record;
+	int nr_files = files ? files->count : 0;
+	const char *path;
+	int i, check;
+
+	nsd = ima_namespace_get(ns);
+	if (!nsd)
+		return -ENOMEM;
+
+	/* Needed to read the namespaced measurement back */
+	if (digest && IS_ERR(ima_shash_tfm(digest->algo)))
+		digest = NULL;
+
+	path = strchr(filename, ':');
+	path = path ? path + 1 : filename;
+
+	record = kmem_cache_zalloc(ima_record_cachep, GFP_KERNEL);
+	if (!record)
+		return -ENOMEM;
+	record->verity = verity;
+	record->namespaced = !digest;
+	record->digest = ima_digest_intern(digest ?: hash);
+	record->path = ima_path_intern(path);
+	for (i = 0; i < nr_files; i++) {
+		record->files[i] = ima_digest_intern(&files->digest[i].hdr);
+		if (!record->files[i])
+			break;
+		record->nr_files++;
+	}
+	if (!record->digest || !record->path || record->nr_files < nr_files) {
+		ima_record_free(record);
+		return -ENOMEM;
+	}
+
+	check = ima_template_digest(entry, record->template_digest);
+	if (check < 0) {
+		ima_record_free(record);
+		return check;
+	}
+
+	/* Lock-free append, ordered and folded in by ima_ns_drain */
+	llist_add(&record->node, &nsd->incoming);
+
+	/* A full batch kicks the flush once, later appends ride along */
+	if (tpm_batch && atomic_inc_return(&nsd->queued) == tpm_batch)
+		mod_delayed_work(ima_async_wq, &ima_vpcr_work, 0);
+
+	return 0;
+}
+
+/*
+ * ima_ns_drain
+ * 	struct ima_namespace *nsd: namespace 
+ *
+ * 	Move appended records into the namespace log, assigning
+ * 	sequence numbers and extending the vPCR in log order
+ */
+static void ima_ns_drain(struct ima_namespace *nsd)
+{
+	struct ima_ns_record *record, *tmp;
+	struct llist_node *incoming;
+
+	if (llist_empty(&nsd->incoming))
+		return;
+
+	spin_lock(&nsd->lock);
+	incoming = llist_reverse_order(llist_del_all(&nsd->incoming));
+	llist_for_each_entry_safe(record, tmp, incoming, node) {
+		record->seq = nsd->count++;
+		ima_vpcr_extend(nsd->vpcr, record->template_digest);
+		list_add_tail(&record->list, &nsd->records);
+		if (tpm_batch)
+			nsd->pending++;
+	}
+	/* Unbatched records reach the TPM before they are appended */
+	if (!nsd->pending)
+		nsd->finalized = nsd->count;
+	spin_unlock(&nsd->lock);
+}
+
+/*
+ * ima_vpcr_store
+ * 	unsigned int ns: namespace 
+ * 	const u8 *vpcr: vPCR value to record
+ *
+ * 	Add an aggregate entry for ns to the IMA list, extending the
+ * 	hardware PCR once for all measurements folded into vpcr
+ */
+static int ima_vpcr_store(unsigned int ns, const u8 *vpcr)
+{
+	int check;
+	char filename[32];
+	struct ima_max_digest_data hash;
+	struct ima_template_entry *entry;
+	struct integrity_iint_cache iint = {};
+	struct ima_event_data event_data = { .iint = &iint,
+					     .filename = filename };
+
+	hash.hdr.algo = HASH_ALGO_SHA256;
+	hash.hdr.length = SHA256_DIGEST_SIZE;
+	memcpy(hash.digest, vpcr, SHA256_DIGEST_SIZE);
+	iint.ima_hash = &hash.hdr;
+	snprintf(filename, sizeof(filename), "%u:%s", ns, IMA_VPCR_NAME);
+
+	check = ima_alloc_init_template(&event_data, &entry, 
+			ima_template_desc_current());
+	if (check < 0)
+		return check;
+
+	check = ima_store_template(entry, 0, NULL, filename, 
+			IMA_CONTAINER_PCR);
+	if (check < 0)
+		ima_free_entry(entry);
+
+	return check == -EEXIST ? 0 : check;
+}
+
+static void ima_vpcr_flush(void)
+{
+	struct ima_namespace *nsd;
+	u8 vpcr[SHA256_DIGEST_SIZE];
+	unsigned int ns;
+	u64 pending, count;
+	int bkt;
+
+	rcu_read_lock();
+	hash_for_each_rcu(ima_namespace_htable, bkt, nsd, hnode) {
+		ima_ns_drain(nsd);
+
+		spin_lock(&nsd->lock);
+		pending = nsd->pending;
+		nsd->pending = 0;
+		count = nsd->count;
+		memcpy(vpcr, nsd->vpcr, sizeof(vpcr));
+		ns = nsd->ns;
+		spin_unlock(&nsd->lock);
+
+		if (!pending)
+			continue;
+
+		/* ima_store_template sleeps, namespaces are never freed */
+		rcu_read_unlock();
+		if (ima_vpcr_store(ns, vpcr) < 0) {
+			pr_err("Failed to extend vPCR of namespace %u\n", ns);
+			/* Retried by the next flush */
+			spin_lock(&nsd->lock);
+			nsd->pending += pending;
+			spin_unlock(&nsd->lock);
+		} else {
+			/* Records up to count may now be exported */
+			spin_lock(&nsd->lock);
+			nsd->finalized = max(nsd->finalized, count);
+			spin_unlock(&nsd->lock);
+			/* The next batch counts from the records still queued */
+			if (atomic_sub_return(min_t(u64, pending, INT_MAX), 
+						&nsd->queued) < 0)
+				atomic_set(&nsd->queued, 0);
+		}
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+}
+
+static void ima_vpcr_work_fn(struct work_struct *work)
+{
+	ima_vpcr_flush();
+
+	queue_delayed_work(ima_async_wq, &ima_vpcr_work, 
+			msecs_to_jiffies(tpm_interval_ms));
+}
+
+static int ima_vpcr_init(void)
+{
+	ima_vpcr_tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(ima_vpcr_tfm))
+		return PTR_ERR(ima_vpcr_tfm);
+
+	ima_epoch = get_random_u64();
+	INIT_DELAYED_WORK(&ima_vpcr_work, ima_vpcr_work_fn);
+	queue_delayed_work(ima_async_wq, &ima_vpcr_work, 
+			msecs_to_jiffies(tpm_interval_ms));
+
+	return 0;
+}
+
+static void ima_vpcr_exit(void)
+{
+	struct ima_namespace *nsd;
+	struct ima_ns_record *record, *tmp;
+	struct hlist_node *htmp;
+	int bkt;
+
+	cancel_delayed_work_sync(&ima_vpcr_work);
+	ima_vpcr_flush();
+
+	hash_for_each_safe(ima_namespace_htable, bkt, htmp, nsd, hnode) {
+		list_for_each_entry_safe(record, tmp, &nsd->records, list)
+			ima_record_free(record);
+		hash_del_rcu(&nsd->hnode);
+		kfree_rcu(nsd, rcu);
+	}
+	crypto_free_shash(ima_vpcr_tfm);
+}
+
+/*
+ * securityfs container_ima/vpcrs
+ * 	One line per namespace: ns measurements vPCR
+ */
+static int ima_vpcrs_show(struct seq_file *m, void *v)
+{
+	struct ima_namespace *nsd;
+	u8 vpcr[SHA256_DIGEST_SIZE];
+	u64 count;
+	int bkt;
+
+	rcu_read_lock();
+	hash_for_each_rcu(ima_namespace_htable, bkt, nsd, hnode) {
+		ima_ns_drain(nsd);
+
+		spin_lock(&nsd->lock);
+		count = nsd->count;
+		memcpy(vpcr, nsd->vpcr, sizeof(vpcr));
+		spin_unlock(&nsd->lock);
+
+		seq_printf(m, "%u %llu %*phN\n", nsd->ns, count, 
+				SHA256_DIGEST_SIZE, vpcr);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+/*
+ * securityfs container_ima/ascii_measurements
+ * 	One line per record, in namespace log order:
+ * 	ns seq template-digest algo:digest ns:file_path
+ * 	With hash_algos, the file digests follow the measurement:
+ * 	ns seq template-digest algo:digest files=algo:digest,... 
+ * 	ns:file_path
+ * 	Exported records are trimmed, see container_ima/export
+ */
+static int ima_ns_measurements_show(struct seq_file *m, void *v)
+{
+	struct ima_namespace *nsd;
+	struct ima_ns_record *record;
+	struct ima_digest_key *key;
+	u8 digest[HASH_MAX_DIGESTSIZE];
+	int bkt, i;
+
+	rcu_read_lock();
+	hash_for_each_rcu(ima_namespace_htable, bkt, nsd, hnode) {
+		ima_ns_drain(nsd);
+
+		spin_lock(&nsd->lock);
+		list_for_each_entry(record, &nsd->records, list) {
+			key = &record->digest->key;
+			if (ima_record_digest(record, nsd->ns, digest) < 0)
+				continue;
+			seq_printf(m, "%u %llu %*phN %s%s:%*phN ", 
+					nsd->ns, record->seq, 
+					SHA256_DIGEST_SIZE, 
+					record->template_digest, 
+					record->verity ? "verity:" : "", 
+					hash_algo_name[key->algo], 
+					key->length, digest);
+			for (i = 0; i < record->nr_files; i++) {
+				key = &record->files[i]->key;
+				seq_printf(m, "%s%s:%*phN", 
+						i ? "," : "files=", 
+						hash_algo_name[key->algo], 
+						key->length, key->digest);
+			}
+			seq_printf(m, "%s%u:%s\n", record->nr_files ? " " : "", 
+					nsd->ns, record->path->path);
+		}
+		spin_unlock(&nsd->lock);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+/*
+ * securityfs container_ima/export
+ * 	Export and trim. A read returns finalized records, those a
+ * 	PCR 11 entry already covers, as struct ima_export_record in
+ * 	namespace and log order. Each open walks the logs once and
+ * 	reads return whole records only. Writing "ns seq" frees the
+ * 	records of ns before seq once a reader has stored them. The
+ * 	vPCR and the record count stay, so trimmed logs still
+ * 	verify against the exported copy.
+ * 	IMA_IOC_NS_READ returns the records of one namespace from a
+ * 	sequence number, finalized or not, in the same layout. New
+ * 	records are at the tail of the log, so a poll walks back
+ * 	over the new records only.
+ */
+
+/* Namespace with the lowest number from ns, caller holds RCU */
+static struct ima_namespace *ima_namespace_next(u64 ns)
+{
+	struct ima_namespace *nsd, *next = NULL;
+	int bkt;
+
+	hash_for_each_rcu(ima_namespace_htable, bkt, nsd, hnode) {
+		if (nsd->ns >= ns && (!next || nsd->ns < next->ns))
+			next = nsd;
+	}
+	return next;
+}
+
+/*
+ * ima_export_fill
+ * 	struct ima_ns_record *record: namespace record
+ * 	unsigned int ns: namespace 
+ * 	u8 *buf: destination
+ * 	size_t len: room left in buf
+ *
+ * 	Returns the size of the export record written to buf, 0 if
+ * 	it does not fit. Caller holds the namespace lock.
+ */
+static ssize_t ima_export_fill(struct ima_ns_record *record, 
+		unsigned int ns, u8 *buf, size_t len)
+{
+	struct ima_export_record *rec = (struct ima_export_record *) buf;
+	struct ima_export_digest *files = (struct ima_export_digest *) 
+		(rec + 1);
+	struct ima_digest_key *key;
+	size_t size;
+	int i, check;
+
+	size = ALIGN(sizeof(*rec) + record->nr_files * sizeof(*files) + 
+			record->path->len + 1, 8);
+	if (size > len)
+		return 0;
+
+	memset(buf, 0, size);
+	check = ima_record_digest(record, ns, rec->digest);
+	if (check < 0)
+		return check;
+
+	key = &record->digest->key;
+	rec->size = size;
+	rec->ns = ns;
+	rec->epoch = ima_epoch;
+	rec->seq = record->seq;
+	memcpy(rec->template_digest, record->template_digest, 
+			SHA256_DIGEST_SIZE);
+	rec->algo = key->algo;
+	rec->length = key->length;
+	rec->flags = record->verity ? IMA_EXPORT_VERITY : 0;
+	rec->nr_files = record->nr_files;
+	rec->path_len = record->path->len;
+	for (i = 0; i < record->nr_files; i++) {
+		key = &record->files[i]->key;
+		files[i].algo = key->algo;
+		files[i].length = key->length;
+		memcpy(files[i].digest, key->digest, key->length);
+	}
+	memcpy(files + record->nr_files, record->path->path, 
+			record->path->len);
+
+	return size;
+}
+
+/*
+ * ima_ns_trim
+ * 	unsigned int ns: namespace 
+ * 	u64 seq: first record to keep
+ *
+ * 	Free the records of ns before seq, finalized ones only
+ */
+static int ima_ns_trim(unsigned int ns, u64 seq)
+{
+	struct ima_namespace *nsd;
+	struct ima_ns_record *record, *tmp;
+	LIST_HEAD(trimmed);
+
+	/* Namespaces are never freed */
+	rcu_read_lock();
+	nsd = ima_namespace_find(ns);
+	rcu_read_unlock();
+	if (!nsd)
+		return -ENOENT;
+
+	spin_lock(&nsd->lock);
+	seq = min(seq, nsd->finalized);
+	list_for_each_entry_safe(record, tmp, &nsd->records, list) {
+		if (record->seq >= seq)
+			break;
+		list_move_tail(&record->list, &trimmed);
+	}
+	nsd->trimmed = max(nsd->trimmed, seq);
+	spin_unlock(&nsd->lock);
+
+	list_for_each_entry_safe(record, tmp, &trimmed, list)
+		ima_record_free(record);
+
+	return 0;
+}
+
+static int ima_export_open(struct inode *inode, struct file *file)
+{
+	file->private_data = kzalloc(sizeof(struct ima_export_cursor), 
+			GFP_KERNEL);
+
+	return file->private_data ? 0 : -ENOMEM;
+}
+
+static int ima_export_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t ima_export_read(struct file *file, char __user *ubuf, 
+		size_t count, loff_t *ppos)
+{
+	struct ima_export_cursor *cur = file->private_data;
+	struct ima_namespace *nsd;
+	struct ima_ns_record *record;
+	size_t len = min_t(size_t, count, IMA_EXPORT_BUF);
+	ssize_t size = 1, copied = 0;
+	u8 *buf;
+
+	buf = kvmalloc(len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	while (size > 0 && (nsd = ima_namespace_next(cur->ns))) {
+		if (nsd->ns != cur->ns) {
+			cur->ns = nsd->ns;
+			cur->seq = 0;
+		}
+		ima_ns_drain(nsd);
+
+		spin_lock(&nsd->lock);
+		list_for_each_entry(record, &nsd->records, list) {
+			if (record->seq < cur->seq)
+				continue;
+			if (record->seq >= nsd->finalized)
+				break;
+			size = ima_export_fill(record, nsd->ns, 
+					buf + copied, len - copied);
+			if (size <= 0)
+				break;
+			copied += size;
+			cur->seq = record->seq + 1;
+		}
+		spin_unlock(&nsd->lock);
+
+		if (size > 0) {
+			cur->ns++;
+			cur->seq = 0;
+		}
+	}
+	rcu_read_unlock();
+
+	if (size < 0 && !copied)
+		copied = size;
+	else if (!size && !copied)
+		/* A record that does not fit an empty buffer never will */
+		copied = -EINVAL;
+	else if (copied && copy_to_user(ubuf, buf, copied))
+		copied = -EFAULT;
+	kvfree(buf);
+
+	if (copied > 0)
+		*ppos += copied;
+	return copied;
+}
+
+static ssize_t ima_export_write(struct file *file, const char __user *ubuf, 
+		size_t count, loff_t *ppos)
+{
+	char buf[48];
+	unsigned int ns;
+	u64 seq;
+	int check;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%u %llu", &ns, &seq) != 2)
+		return -EINVAL;
+
+	check = ima_ns_trim(ns, seq);
+	return check < 0 ? check : count;
+}
+
+/*
+ * ima_ns_read
+ * 	struct ima_ns_read *req: namespace, first record and buffer
+ *
+ * 	Fill req->buf with the records of req->ns from req->seq, set
+ * 	count and the next seq. Trimmed records are skipped.
+ */
+static int ima_ns_read(struct ima_ns_read *req)
+{
+	struct ima_namespace *nsd;
+	struct ima_ns_record *record;
+	size_t len = min_t(size_t, req->len, IMA_EXPORT_BUF);
+	ssize_t size = 1, copied = 0;
+	u8 *buf;
+
+	/* Namespaces are never freed */
+	rcu_read_lock();
+	nsd = ima_namespace_find(req->ns);
+	rcu_read_unlock();
+	if (!nsd)
+		return -ENOENT;
+
+	buf = kvmalloc(len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	req->count = 0;
+	ima_ns_drain(nsd);
+
+	spin_lock(&nsd->lock);
+	list_for_each_entry_reverse(record, &nsd->records, list) {
+		if (record->seq < req->seq)
+			break;
+	}
+	/* From the last record before seq, or the start of the log */
+	list_for_each_entry_continue(record, &nsd->records, list) {
+		size = ima_export_fill(record, nsd->ns, buf + copied, 
+				len - copied);
+		if (size <= 0)
+			break;
+		copied += size;
+		req->count++;
+		req->seq = record->seq + 1;
+	}
+	spin_unlock(&nsd->lock);
+
+	if (size < 0 && !copied)
+		copied = size;
+	else if (!size && !copied)
+		/* A record that does not fit an empty buffer never will */
+		copied = -EINVAL;
+	else if (copied && copy_to_user(u64_to_user_ptr(req->buf), buf, 
+				copied))
+		copied = -EFAULT;
+	kvfree(buf);
+
+	return copied < 0 ? copied : 0;
+}
+
+static long ima_export_ioctl(struct file *file, unsigned int cmd, 
+		unsigned long arg)
+{
+	struct ima_ns_read req;
+	void __user *ureq = (void __user *) arg;
+	int check;
+
+	if (cmd != IMA_IOC_NS_READ)
+		return -ENOTTY;
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	check = ima_ns_read(&req);
+	if (check < 0)
+		return check;
+
+	return copy_to_user(ureq, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+static const struct file_operations ima_export_fops = {
+	.owner = THIS_MODULE,
+	.open = ima_export_open,
+	.read = ima_export_read,
+	.write = ima_export_write,
+	.unlocked_ioctl = ima_export_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.release = ima_export_release,
+	.llseek = noop_llseek,
+};
+
+/*
+ * debugfs container_ima/memory
+ * 	Namespace log memory, interned entries counted once:
+ * 	records count bytes
+ * 	digests count bytes
+ * 	paths count bytes
+ * 	trimmed count
+ * 	bytes_per_record shared unshared
+ * 	unshared is the size of the same records each holding its
+ * 	own copy of every digest and path
+ */
+static int ima_memory_show(struct seq_file *m, void *v)
+{
+	struct ima_namespace *nsd;
+	struct ima_ns_record *record;
+	u64 records = 0, unshared = 0, trimmed = 0, shared;
+	u64 record_bytes, digest_bytes, path_bytes;
+	unsigned int record_size = kmem_cache_size(ima_record_cachep);
+	int digests, paths, bkt;
+
+	rcu_read_lock();
+	hash_for_each_rcu(ima_namespace_htable, bkt, nsd, hnode) {
+		ima_ns_drain(nsd);
+
+		spin_lock(&nsd->lock);
+		trimmed += nsd->trimmed;
+		list_for_each_entry(record, &nsd->records, list) {
+			records++;
+			unshared += record_size + record->path->len + 1 + 
+				(1 + record->nr_files) * 
+				sizeof(struct ima_digest_key);
+		}
+		spin_unlock(&nsd->lock);
+	}
+	rcu_read_unlock();
+
+	digests = atomic_read(&ima_interned_digests);
+	paths = atomic_read(&ima_interned_paths);
+	record_bytes = records * record_size;
+	digest_bytes = (u64) digests * sizeof(struct ima_digest_ref);
+	path_bytes = atomic_long_read(&ima_interned_path_bytes);
+	shared = record_bytes + digest_bytes + path_bytes;
+
+	seq_printf(m, "records %llu %llu\n", records, record_bytes);
+	seq_printf(m, "digests %d %llu\n", digests, digest_bytes);
+	seq_printf(m, "paths %d %llu\n", paths, path_bytes);
+	seq_printf(m, "trimmed %llu\n", trimmed);
+	seq_printf(m, "bytes_per_record %llu %llu\n", 
+			records ? div64_u64(shared, records) : 0, 
+			records ? div64_u64(unshared, records) : 0);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(ima_vpcrs);
+DEFINE_SHOW_ATTRIBUTE(ima_ns_measurements);
+DEFINE_SHOW_ATTRIBUTE(ima_memory);
+
+static struct dentry *ima_securityfs_dir;
+static struct dentry *ima_vpcrs_file;
+static struct dentry *ima_ns_measurements_file;
+static struct dentry *ima_export_file;
+
+static void ima_securityfs_exit(void)
+{
+	securityfs_remove(ima_export_file);
+	securityfs_remove(ima_ns_measurements_file);
+	securityfs_remove(ima_vpcrs_file);
+	securityfs_remove(ima_securityfs_dir);
+}
+
+static int ima_securityfs_init(void)
+{
+	ima_securityfs_dir = securityfs_create_dir("container_ima", NULL);
+	if (IS_ERR(ima_securityfs_dir))
+		return PTR_ERR(ima_securityfs_dir);
+
+	ima_vpcrs_file = securityfs_create_file("vpcrs", 0440, 
+			ima_securityfs_dir, NULL, &ima_vpcrs_fops);
+	ima_ns_measurements_file = securityfs_create_file(
+			"ascii_measurements", 0440, ima_securityfs_dir, 
+			NULL, &ima_ns_measurements_fops);
+	ima_export_file = securityfs_create_file("export", 0600, 
+			ima_securityfs_dir, NULL, &ima_export_fops);
+	if (IS_ERR(ima_vpcrs_file) || IS_ERR(ima_ns_measurements_file) || 
+			IS_ERR(ima_export_file)) {
+		if (IS_ERR(ima_vpcrs_file))
+			ima_vpcrs_file = NULL;
+		if (IS_ERR(ima_ns_measurements_file))
+			ima_ns_measurements_file = NULL;
+		if (IS_ERR(ima_export_file))
+			ima_export_file = NULL;
+		ima_securityfs_exit();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * __ima_store_measurement
+ * 	struct ima_max_digest_data *hash: hash information
+ * 	struct file *file: file measured
+ * 	char *filename: name of measured file (ns:file path) 
+ * 	int length: size of hash data
+ * 	struct ima_template_desc *desc: description of IMA template
+ * 	int hash_algo: algorithm used in measurement 
+ * 	unsigned int ns: namespace 
+ * 	struct ima_digest_data *digest: file digest, or NULL
+ * 	bool verity: hash is derived from the fs-verity digest
+ * 	struct ima_file_digests *files: hash_algos file digests, or NULL
+ *
+ * 	Store file with namespaced measurement and file name
+ * 	in the namespace log, extending its vPCR
+ * 	Extend to pcr 11, unless batched (tpm_batch)
+ * 	Verity measurements carry IMA_VERITY_REQUIRED, which d-ngv2
+ * 	template fields record as a "verity:" digest
+ */
+static int __ima_store_measurement(struct ima_max_digest_data *hash, 
+		struct file *file, char *filename, int length, 
+		struct ima_template_desc *desc, int hash_algo, 
+		unsigned int ns, struct ima_digest_data *digest, 
+		bool verity, struct ima_file_digests *files)
+{
+
+	int check;
+	u64 i_version, start;
+	struct inode *inode;
+	struct ima_template_entry *entry;
+        struct integrity_iint_cache iint = {};
+
+	/* init inode integrity data */
+	inode = file->f_inode;
+	i_version = inode_query_iversion(inode);
+
+        iint.inode = inode;
+        iint.ima_hash = &hash->hdr;
+        iint.ima_hash->algo =  hash_algo;
+        iint.ima_hash->length = hash_digest_size[hash_algo];
+        iint.version = i_version;
+	iint.flags = verity ? IMA_VERITY_REQUIRED : 0;
+        
+	memcpy(hash->hdr.digest, hash->digest, sizeof(hash->digest));
+
+        memcpy(iint.ima_hash, hash, length);
+        
+	/* IMA event data */
+	struct ima_event_data event_data = { .iint = &iint,
+                                             .file = file,
+                                             .filename = filename
+                                           };
+
+	/* IMA template field data */
+	start = ima_stage_start();
+        check = ima_alloc_init_template(&event_data, &entry, desc);
+	ima_stage_end(IMA_STAGE_ALLOC_TEMPLATE, start, check);
+        if (check < 0) {
+                return check;
+        }
+
+	/* Batched, the TPM only gets the namespace aggregate */
+	if (tpm_batch) {
+		check = ima_ns_record(ns, entry, &hash->hdr, digest, 
+				filename, verity, files);
+		ima_free_entry(entry);
+		return check;
+	}
+
+	/* Store template, extend to PCR 11 */
+	start = ima_stage_start();
+        check = ima_store_template(entry, 0, inode, filename, 
+			IMA_CONTAINER_PCR);
+	ima_stage_end(IMA_STAGE_STORE_TEMPLATE, start, 
+			check == -EEXIST ? 0 : check);
+        if (!check) {
+		ima_ns_record(ns, entry, &hash->hdr, digest, filename, 
+				verity, files);
+                return 0;
+	}
+
+	/* Clean up if needed, entry was not added to the list */
+	ima_free_entry(entry);
+
+	/* Already in the measurement list */
+	if (check == -EEXIST)
+		return 0;
+
+	return check;
+}
+
+/*
+ * ima_store_measurement
+ * 	See __ima_store_measurement, for full file hashes
+ */
+noinline int ima_store_measurement(struct ima_max_digest_data *hash, 
+		struct file *file, char *filename, int length, 
+		struct ima_template_desc *desc, int hash_algo, 
+		unsigned int ns)
+{
+	return __ima_store_measurement(hash, file, filename, length, desc, 
+			hash_algo, ns, NULL, false, NULL);
+}
+
+/*
+ * Policy decision cache
+ * 	ima_get_action() walks the whole rule list. Its answer only
+ * 	depends on the inputs rules can match for an mmap: the
+ * 	superblock (fsmagic, fsuuid, fsname), file owner and group,
+ * 	the task's uids and gids, subject and object LSM labels,
+ * 	mask and hook. Decisions, including "don't measure", are
+ * 	cached under those inputs and tagged with the policy
+ * 	generation, which is bumped after the IMA policy is updated
+ * 	or an LSM policy reload rewrites IMA's label rules.
+ */
+static DEFINE_HASHTABLE(ima_policy_htable, IMA_POLICY_CACHE_BITS);
+static DEFINE_SPINLOCK(ima_policy_lock);
+static atomic_t ima_policy_entries = ATOMIC_INIT(0);
+static atomic_t ima_policy_generation = ATOMIC_INIT(0);
+static bool ima_policy_cache_ready;
+
+static int ima_policy_changed(struct kretprobe_instance *ri, 
+		struct pt_regs *regs)
+{
+	atomic_inc(&ima_policy_generation);
+	return 0;
+}
+
+static struct kretprobe policy_update_krp = {
+	.kp.symbol_name = "ima_update_policy",
+	.handler = ima_policy_changed,
+};
+
+static struct kretprobe lsm_policy_krp = {
+	.kp.symbol_name = "ima_lsm_policy_change",
+	.handler = ima_policy_changed,
+};
+
+static void ima_policy_cache_flush(void)
+{
+	struct ima_policy_cache *entry;
+	struct hlist_node *tmp;
+	int bkt;
+
+	spin_lock(&ima_policy_lock);
+	hash_for_each_safe(ima_policy_htable, bkt, tmp, entry, hnode) {
+		hash_del_rcu(&entry->hnode);
+		kfree_rcu(entry, rcu);
+	}
+	atomic_set(&ima_policy_entries, 0);
+	spin_unlock(&ima_policy_lock);
+}
+
+static void ima_policy_cache_insert(struct ima_policy_cache *new_entry, 
+		u32 key_hash)
+{
+	struct ima_policy_cache *entry;
+
+	if (atomic_read(&ima_policy_entries) >= policy_cache_max)
+		ima_policy_cache_flush();
+
+	spin_lock(&ima_policy_lock);
+	hash_for_each_possible(ima_policy_htable, entry, hnode, key_hash) {
+		if (memcmp(&entry->key, &new_entry->key, sizeof(entry->key)))
+			continue;
+		hlist_replace_rcu(&entry->hnode, &new_entry->hnode);
+		spin_unlock(&ima_policy_lock);
+		kfree_rcu(entry, rcu);
+		return;
+	}
+	hash_add_rcu(ima_policy_htable, &new_entry->hnode, key_hash);
+	atomic_inc(&ima_policy_entries);
+	spin_unlock(&ima_policy_lock);
+}
+
+/*
+ * ima_get_action_cached
+ * 	Same arguments and result as ima_get_action, for a file
+ * 	mapped by the current task
+ */
+static int ima_get_action_cached(struct mnt_idmap *idmap, 
+		struct inode *inode, const struct cred *cred, u32 secid, 
+		int mask, enum ima_hooks func, int *pcr, 
+		struct ima_template_desc **desc, unsigned int *allowed_algos)
+{
+	struct ima_policy_cache *entry;
+	struct ima_policy_key key;
+	int action, generation;
+	u32 key_hash;
+	u64 start;
+
+	if (!policy_cache || !ima_policy_cache_ready) {
+		start = ima_stage_start();
+		action = ima_get_action(idmap, inode, cred, secid, mask, 
+				func, pcr, desc, NULL, allowed_algos);
+		ima_stage_end(IMA_STAGE_GET_ACTION, start, 0);
+		ima_stage_hit(IMA_STAGE_GET_ACTION, false);
+		return action;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.sb = inode->i_sb;
+	key.magic = inode->i_sb->s_magic;
+	key.dev = inode->i_sb->s_dev;
+	key.uuid = inode->i_sb->s_uuid;
+	key.idmap = idmap;
+	key.fowner = inode->i_uid;
+	key.fgroup = inode->i_gid;
+	key.uid = cred->uid;
+	key.euid = cred->euid;
+	key.gid = cred->gid;
+	key.egid = cred->egid;
+	key.secid = secid;
+	security_inode_getsecid(inode, &key.osecid);
+	key.mask = mask;
+	key.func = func;
+	key_hash = jhash(&key, sizeof(key), 0);
+
+	/* Sample first, an update during the walk invalidates it */
+	generation = atomic_read(&ima_policy_generation);
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(ima_policy_htable, entry, hnode, key_hash) {
+		if (memcmp(&entry->key, &key, sizeof(key)))
+			continue;
+		if (entry->generation != generation)
+			break;
+		action = entry->action;
+		*pcr = entry->pcr;
+		*desc = entry->desc;
+		*allowed_algos = entry->allowed_algos;
+		rcu_read_unlock();
+		ima_stage_hit(IMA_STAGE_GET_ACTION, true);
+		return action;
+	}
+	rcu_read_unlock();
+
+	start = ima_stage_start();
+	action = ima_get_action(idmap, inode, cred, secid, mask, func, 
+			pcr, desc, NULL, allowed_algos);
+	ima_stage_end(IMA_STAGE_GET_ACTION, start, 0);
+	ima_stage_hit(IMA_STAGE_GET_ACTION, false);
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return action;
+
+	entry->key = key;
+	entry->generation = generation;
+	entry->action = action;
+	entry->pcr = *pcr;
+	entry->desc = *desc;
+	entry->allowed_algos = *allowed_algos;
+	ima_policy_cache_insert(entry, key_hash);
+
+	return action;
+}
+
+static void ima_policy_cache_init(void)
+{
+	if (register_kretprobe(&policy_update_krp) < 0) {
+		pr_warn("Policy cache disabled, cannot probe ima_update_policy\n");
+		return;
+	}
+	if (register_kretprobe(&lsm_policy_krp) < 0) {
+		pr_warn("Policy cache disabled, cannot probe ima_lsm_policy_change\n");
+		unregister_kretprobe(&policy_update_krp);
+		return;
+	}
+	ima_policy_cache_ready = true;
+}
+
+static void ima_policy_cache_exit(void)
+{
+	if (ima_policy_cache_ready) {
+		unregister_kretprobe(&lsm_policy_krp);
+		unregister_kretprobe(&policy_update_krp);
+	}
+	ima_policy_cache_flush();
+}
+
+/*
+ * In-flight file hashes
+ * 	Containers started together map the same uncached binary at
+ * 	the same time. The first caller for an (inode, i_version)
+ * 	hashes the file, later callers wait for its result instead
+ * 	of reading and hashing the file again.
+ */
+static DEFINE_HASHTABLE(ima_inflight_htable, IMA_INFLIGHT_BITS);
+static DEFINE_SPINLOCK(ima_inflight_lock);
+static atomic_t ima_hashes = ATOMIC_INIT(0);
+static atomic_t ima_hash_joins = ATOMIC_INIT(0);
+static atomic_t ima_verity_digests = ATOMIC_INIT(0);
+static atomic_t ima_iint_reuses = ATOMIC_INIT(0);
+
+static void ima_inflight_put(struct ima_inflight *flight)
+{
+	if (refcount_dec_and_test(&flight->ref))
+		kfree(flight);
+}
+
+/*
+ * ima_inflight_start
+ * 	struct inode *inode: inode to be hashed
+ * 	u64 version: i_version sampled before hashing
+ * 	int algo: hash algorithm
+ * 	bool *leader: set if the caller must hash and finish
+ *
+ * 	Returns the in-flight hash for (inode, version, algo), or
+ * 	NULL if the caller should hash on its own
+ */
+static struct ima_inflight *ima_inflight_start(struct inode *inode, 
+		u64 version, int algo, bool *leader)
+{
+	struct ima_inflight *flight, *new_flight;
+
+	new_flight = kzalloc(sizeof(*new_flight), GFP_KERNEL);
+
+	spin_lock(&ima_inflight_lock);
+	hash_for_each_possible(ima_inflight_htable, flight, hnode, 
+			(unsigned long) inode) {
+		if (flight->inode == inode && flight->version == version && 
+				flight->algo == algo) {
+			refcount_inc(&flight->ref);
+			spin_unlock(&ima_inflight_lock);
+			kfree(new_flight);
+			*leader = false;
+			return flight;
+		}
+	}
+
+	flight = new_flight;
+	if (flight) {
+		flight->inode = inode;
+		flight->version = version;
+		flight->algo = algo;
+		init_completion(&flight->done);
+		/* one reference for the table, one for the leader */
+		refcount_set(&flight->ref, 2);
+		hash_add(ima_inflight_htable, &flight->hnode, 
+				(unsigned long) inode);
+	}
+	spin_unlock(&ima_inflight_lock);
+
+	*leader = true;
+	return flight;
+}
+
+/*
+ * ima_inflight_finish
+ * 	struct ima_inflight *flight: hash started by the caller
+ * 	int result: hash algorithm or negative error
+ * 	struct ima_max_digest_data *hash: file digest
+ *
+ * 	Publish the result to waiters and retire flight
+ */
+static void ima_inflight_finish(struct ima_inflight *flight, int result, 
+		struct ima_max_digest_data *hash)
+{
+	flight->result = result;
+	if (result >= 0)
+		memcpy(&flight->hash, hash, sizeof(flight->hash));
+
+	spin_lock(&ima_inflight_lock);
+	hash_del(&flight->hnode);
+	spin_unlock(&ima_inflight_lock);
+
+	complete_all(&flight->done);
+	ima_inflight_put(flight);
+	ima_inflight_put(flight);
+}
+
+/*
+ * ima_real_inode
+ * 	struct file *file: file being measured
+ *
+ * 	Inode holding the file contents. Through overlayfs this is
+ * 	the backing inode in the image layer, which is shared by
+ * 	every container mounting that layer, so caches keyed by it
+ * 	hash a shared layer once per node.
+ */
+static struct inode *ima_real_inode(struct file *file)
+{
+	return d_real_inode(file->f_path.dentry);
+}
+
+/*
+ * ima_iint_digest
+ * 	struct inode *inode: inode whose iint is looked up
+ * 	u64 version: i_version of the backing inode
+ * 	int algo: hash algorithm
+ * 	struct ima_max_digest_data *hash: file digest (out)
+ *
+ * 	Reuse the digest host IMA collected for inode if it was
+ * 	taken with algo at version. IMA records the change cookie of
+ * 	the backing inode, so this also holds for overlay inodes.
+ * 	Returns true when hash holds the digest.
+ */
+static bool ima_iint_digest(struct inode *inode, u64 version, int algo, 
+		struct ima_max_digest_data *hash)
+{
+	struct integrity_iint_cache *iint;
+	struct ima_digest_data *digest;
+	bool found = false;
+
+	iint = integrity_iint_find(inode);
+	if (!iint)
+		return false;
+
+	mutex_lock(&iint->mutex);
+	digest = iint->ima_hash;
+	if ((iint->flags & IMA_COLLECTED) && 
+			!(iint->flags & IMA_VERITY_REQUIRED) && 
+			iint->version == version && digest && 
+			digest->algo == algo && 
+			digest->length <= sizeof(hash->digest)) {
+		hash->hdr.algo = algo;
+		hash->hdr.length = digest->length;
+		memcpy(hash->digest, digest->digest, digest->length);
+		found = true;
+	}
+	mutex_unlock(&iint->mutex);
+
+	return found;
+}
+
+/*
+ * Single-pass file digests
+ * 	hash_algos names the file digests verifiers want besides the
+ * 	measured one. A file that has to be hashed is read once in
+ * 	chunks, and each chunk is fed to every algorithm. The extra
+ * 	digests go to the digest store, where namespace records and
+ * 	containers measuring with one of those algorithms pick them
+ * 	up.
+ *
+ * 	Transforms are allocated by algorithm name, so the crypto API
+ * 	hands out its highest-priority driver (sha256-ni over
+ * 	sha256-avx2 over sha256-generic). The drivers chosen are
+ * 	logged at init and listed in debugfs drivers. Files of at
+ * 	least ahash_minsize bytes go through ahash, reading the next
+ * 	chunk while the drivers hash the current one.
+ */
+static int ima_algos[IMA_MAX_ALGOS];
+static int ima_nr_algos;
+static int ima_default_algo;
+static atomic_t ima_ahashes = ATOMIC_INIT(0);
+
+/*
+ * ima_multi_shash
+ * 	struct file *file: file to be hashed
+ * 	struct ima_file_digests *digests: algorithms to compute, 
+ * 	digests->digest[i].hdr.algo, receives the digests
+ *
+ * 	Hash file with every algorithm in one synchronous read
+ */
+static int ima_multi_shash(struct file *file, struct ima_file_digests *digests)
+{
+	struct shash_desc *descs[IMA_MAX_ALGOS + 1] = {};
+	struct ima_max_digest_data *hash;
+	struct crypto_shash *tfm;
+	loff_t pos = 0;
+	ssize_t len;
+	void *buf;
+	int i, check;
+
+	buf = kmalloc(IMA_HASH_CHUNK, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < digests->count; i++) {
+		tfm = ima_shash_tfm(digests->digest[i].hdr.algo);
+		if (IS_ERR(tfm)) {
+			check = PTR_ERR(tfm);
+			goto out;
+		}
+		descs[i] = kzalloc(sizeof(*descs[i]) + 
+				crypto_shash_descsize(tfm), GFP_KERNEL);
+		if (!descs[i]) {
+			check = -ENOMEM;
+			goto out;
+		}
+		descs[i]->tfm = tfm;
+		check = crypto_shash_init(descs[i]);
+		if (check < 0)
+			goto out;
+	}
+
+	/* Each chunk is read once and fed to every algorithm */
+	while ((len = kernel_read(file, buf, IMA_HASH_CHUNK, &pos)) > 0) {
+		for (i = 0; i < digests->count; i++) {
+			check = crypto_shash_update(descs[i], buf, len);
+			if (check < 0)
+				goto out;
+		}
+		cond_resched();
+	}
+	if (len < 0) {
+		check = len;
+		goto out;
+	}
+
+	for (i = 0; i < digests->count; i++) {
+		hash = &digests->digest[i];
+		hash->hdr.length = hash_digest_size[hash->hdr.algo];
+		check = crypto_shash_final(descs[i], hash->digest);
+		if (check < 0)
+			goto out;
+	}
+out:
+	for (i = 0; i < digests->count; i++)
+		kfree(descs[i]);
+	kfree(buf);
+
+	return check;
+}
+
+/*
+ * ima_multi_ahash
+ * 	See ima_multi_shash
+ *
+ * 	Chunks are submitted to every algorithm's ahash request, and
+ * 	the next chunk is read into the other buffer before waiting
+ * 	for them, so an asynchronous driver hashes while the page
+ * 	cache is read
+ */
+static int ima_multi_ahash(struct file *file, struct ima_file_digests *digests)
+{
+	struct ahash_request *reqs[IMA_MAX_ALGOS + 1] = {};
+	struct crypto_wait waits[IMA_MAX_ALGOS + 1];
+	int pending[IMA_MAX_ALGOS + 1];
+	struct ima_max_digest_data *hash;
+	struct scatterlist sg[2];
+	void *bufs[2];
+	loff_t pos = 0;
+	ssize_t len;
+	int i, ret, cur = 0, check = -ENOMEM;
+
+	bufs[0] = kmalloc(IMA_AHASH_CHUNK, GFP_KERNEL);
+	bufs[1] = kmalloc(IMA_AHASH_CHUNK, GFP_KERNEL);
+	if (!bufs[0] || !bufs[1])
+		goto out;
+
+	for (i = 0; i < digests->count; i++) {
+		reqs[i] = ahash_request_alloc(
+				ima_ahash_tfm(digests->digest[i].hdr.algo), 
+				GFP_KERNEL);
+		if (!reqs[i]) {
+			check = -ENOMEM;
+			goto out;
+		}
+		crypto_init_wait(&waits[i]);
+		ahash_request_set_callback(reqs[i], 
+				CRYPTO_TFM_REQ_MAY_BACKLOG | 
+				CRYPTO_TFM_REQ_MAY_SLEEP, 
+				crypto_req_done, &waits[i]);
+		check = crypto_wait_req(crypto_ahash_init(reqs[i]), 
+				&waits[i]);
+		if (check < 0)
+			goto out;
+	}
+
+	len = kernel_read(file, bufs[cur], IMA_AHASH_CHUNK, &pos);
+	while (len > 0) {
+		sg_init_one(&sg[cur], bufs[cur], len);
+		for (i = 0; i < digests->count; i++) {
+			ahash_request_set_crypt(reqs[i], &sg[cur], NULL, len);
+			pending[i] = crypto_ahash_update(reqs[i]);
+		}
+
+		/* Read ahead while the drivers work on this chunk */
+		cur ^= 1;
+		len = kernel_read(file, bufs[cur], IMA_AHASH_CHUNK, &pos);
+
+		/* Wait for all, the buffer is reused next round */
+		for (i = 0; i < digests->count; i++) {
+			ret = crypto_wait_req(pending[i], &waits[i]);
+			if (ret < 0 && !check)
+				check = ret;
+		}
+		if (check < 0)
+			goto out;
+		cond_resched();
+	}
+	if (len < 0) {
+		check = len;
+		goto out;
+	}
+
+	for (i = 0; i < digests->count; i++) {
+		hash = &digests->digest[i];
+		hash->hdr.length = hash_digest_size[hash->hdr.algo];
+		ahash_request_set_crypt(reqs[i], NULL, hash->digest, 0);
+		check = crypto_wait_req(crypto_ahash_final(reqs[i]), 
+				&waits[i]);
+		if (check < 0)
+			goto out;
+	}
+	atomic_inc(&ima_ahashes);
+out:
+	for (i = 0; i < digests->count; i++)
+		ahash_request_free(reqs[i]);
+	kfree(bufs[0]);
+	kfree(bufs[1]);
+
+	return check;
+}
+
+/*
+ * ima_multi_hash
+ * 	struct file *file: file to be hashed
+ * 	struct ima_file_digests *digests: algorithms to compute, 
+ * 	digests->digest[i].hdr.algo, receives the digests
+ *
+ * 	Hash file with every algorithm in one read, through ahash
+ * 	for files of at least ahash_minsize bytes. Files IMA would
+ * 	have to reopen or read around the page cache are left to
+ * 	ima_calc_file_hash.
+ */
+static int ima_multi_hash(struct file *file, struct ima_file_digests *digests)
+{
+	bool use_ahash;
+	int i;
+
+	if (!(file->f_mode & FMODE_READ) || 
+			!(file->f_mode & FMODE_CAN_READ) || 
+			(file->f_flags & O_DIRECT))
+		return -EBADF;
+
+	use_ahash = ahash_minsize && 
+		i_size_read(file_inode(file)) >= ahash_minsize;
+	for (i = 0; use_ahash && i < digests->count; i++)
+		use_ahash = !IS_ERR(ima_ahash_tfm(digests->digest[i].hdr.algo));
+
+	if (use_ahash)
+		return ima_multi_ahash(file, digests);
+	return ima_multi_shash(file, digests);
+}
+
+/*
+ * ima_hash_all
+ * 	struct file *file: file to be hashed
+ * 	struct inode *inode: backing inode of file
+ * 	u64 version: i_version sampled before hashing
+ * 	int algo: hash algorithm of the measurement
+ * 	struct ima_max_digest_data *hash: file digest (out)
+ *
+ * 	Compute the algo digest together with the hash_algos ones,
+ * 	which are added to the digest store.
+ * 	Returns algo or a negative error.
+ */
+static int ima_hash_all(struct file *file, struct inode *inode, 
+		u64 version, int algo, struct ima_max_digest_data *hash)
+{
+	struct ima_file_digests *digests;
+	int i, check;
+
+	digests = kzalloc(sizeof(*digests), GFP_KERNEL);
+	if (!digests)
+		return -ENOMEM;
+
+	digests->digest[digests->count++].hdr.algo = algo;
+	for (i = 0; i < ima_nr_algos; i++) {
+		if (ima_algos[i] != algo)
+			digests->digest[digests->count++].hdr.algo = 
+				ima_algos[i];
+	}
+
+	check = ima_multi_hash(file, digests);
+	if (check < 0)
+		goto out;
+
+	for (i = 1; i < digests->count; i++)
+		ima_digest_insert(inode, version, &digests->digest[i].hdr);
+	memcpy(hash, &digests->digest[0], sizeof(*hash));
+	check = algo;
+out:
+	kfree(digests);
+
+	return check;
+}
+
+/*
+ * ima_crypto_select
+ * 	int algo: hash algorithm the module will use
+ *
+ * 	Allocate the transforms of algo now rather than on the first
+ * 	measurement, and report the drivers the crypto API chose
+ */
+static int ima_crypto_select(int algo)
+{
+	struct crypto_shash *tfm;
+	struct crypto_ahash *atfm;
+	const char *driver;
+
+	tfm = ima_shash_tfm(algo);
+	if (IS_ERR(tfm)) {
+		pr_err("Hash algorithm %s not available\n", 
+				hash_algo_name[algo]);
+		return PTR_ERR(tfm);
+	}
+	driver = crypto_shash_driver_name(tfm);
+	pr_info("%s: shash %s\n", hash_algo_name[algo], driver);
+	if (strstr(driver, "generic"))
+		pr_warn("%s: no accelerated driver loaded\n", 
+				hash_algo_name[algo]);
+
+	if (!ahash_minsize)
+		return 0;
+
+	atfm = ima_ahash_tfm(algo);
+	if (IS_ERR(atfm))
+		pr_warn("%s: no ahash driver, hashing synchronously\n", 
+				hash_algo_name[algo]);
+	else
+		pr_info("%s: ahash %s\n", hash_algo_name[algo], 
+				crypto_ahash_driver_name(atfm));
+
+	return 0;
+}
+
+/*
+ * debugfs container_ima/drivers
+ * 	algo shash-driver ahash-driver, for every algorithm in use,
+ * 	"-" when no transform was allocated
+ */
+static int ima_drivers_show(struct seq_file *m, void *v)
+{
+	struct crypto_shash *tfm;
+	struct crypto_ahash *atfm;
+	int algo;
+
+	for (algo = 0; algo < HASH_ALGO__LAST; algo++) {
+		tfm = smp_load_acquire(&ima_tfms[algo]);
+		atfm = smp_load_acquire(&ima_atfms[algo]);
+		if (!tfm && !atfm)
+			continue;
+		seq_printf(m, "%s %s %s\n", hash_algo_name[algo], 
+				tfm ? crypto_shash_driver_name(tfm) : "-", 
+				atfm ? crypto_ahash_driver_name(atfm) : "-");
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(ima_drivers);
+
+static int ima_hash_algos_init(void)
+{
+	char *algos, *cur, *name;
+	int i, algo, ret;
+
+	ima_default_algo = ima_hash_algo;
+	if (hash_algo && *hash_algo) {
+		ima_default_algo = match_string(hash_algo_name, 
+				HASH_ALGO__LAST, hash_algo);
+		if (ima_default_algo < 0) {
+			pr_err("Invalid hash_algo %s\n", hash_algo);
+			return -EINVAL;
+		}
+	}
+
+	ret = ima_crypto_select(ima_default_algo);
+	if (ret < 0 || !hash_algos || !*hash_algos)
+		return ret;
+
+	algos = kstrdup(hash_algos, GFP_KERNEL);
+	if (!algos)
+		return -ENOMEM;
+
+	cur = algos;
+	while ((name = strsep(&cur, ",")) != NULL) {
+		if (!*name)
+			continue;
+		algo = match_string(hash_algo_name, HASH_ALGO__LAST, name);
+		if (algo < 0 || ima_nr_algos == IMA_MAX_ALGOS) {
+			pr_err("Invalid hash_algos entry %s\n", name);
+			ret = -EINVAL;
+			break;
+		}
+
+		for (i = 0; i < ima_nr_algos; i++) {
+			if (ima_algos[i] == algo)
+				break;
+		}
+		if (i < ima_nr_algos)
+			continue;
+
+		ret = ima_crypto_select(algo);
+		if (ret < 0)
+			break;
+		ima_algos[ima_nr_algos++] = algo;
+	}
+	kfree(algos);
+
+	return ret;
+}
+
+static void ima_hash_algos_exit(void)
+{
+	int algo;
+
+	for (algo = 0; algo < HASH_ALGO__LAST; algo++) {
+		if (ima_tfms[algo])
+			crypto_free_shash(ima_tfms[algo]);
+		if (ima_atfms[algo])
+			crypto_free_ahash(ima_atfms[algo]);
+	}
+}
+
 /*
- * ima_store_measurement
- * 	struct ima_max_digest_data *hash: hash information
+ * ima_file_digest
+ * 	struct file *file: file to be hashed
+ * 	struct inode *inode: backing inode of file
+ * 	u64 version: i_version sampled before hashing
+ * 	int algo: hash algorithm
+ * 	struct ima_max_digest_data *hash: file digest (out)
+ *
+ * 	The file digest only depends on the inode contents, so it
+ * 	is computed once per inode version and algorithm and reused
+ * 	by every namespace that maps the file. A digest host IMA
+ * 	already collected for this version is reused (reuse_iint).
+ * 	Concurrent callers for the same inode version share a single
+ * 	hash, which also computes the hash_algos digests in the same
+ * 	read (ima_hash_all). For files it cannot read, IMA's own
+ * 	algorithm goes through ima_file_hash and others through
+ * 	ima_calc_file_hash.
+ * 	Returns the hash algorithm or a negative error.
+ */
+static int ima_file_digest(struct file *file, struct inode *inode, 
+		u64 version, int algo, struct ima_max_digest_data *hash)
+{
+	struct ima_inflight *flight = NULL;
+	bool leader = true;
+	int hash_algo;
+	u64 start;
+
+	if (ima_digest_lookup(inode, algo, hash)) {
+		ima_stage_hit(IMA_STAGE_FILE_HASH, true);
+		return hash->hdr.algo;
+	}
+
+	/* Measured by host IMA, either through the overlay or not */
+	if (reuse_iint && integrity_iint_find && ima_cache_usable(inode) && 
+			(ima_iint_digest(inode, version, algo, hash) || 
+			 (file_inode(file) != inode && 
+			  ima_iint_digest(file_inode(file), version, algo, 
+				  hash)))) {
+		atomic_inc(&ima_iint_reuses);
+		ima_stage_hit(IMA_STAGE_FILE_HASH, true);
+		ima_digest_insert(inode, version, &hash->hdr);
+		return hash->hdr.algo;
+	}
+
+	/* Join a concurrent hash of the same inode version */
+	if (ima_cache_usable(inode))
+		flight = ima_inflight_start(inode, version, algo, &leader);
+	if (flight && !leader) {
+		hash_algo = -EINTR;
+		if (!wait_for_completion_killable(&flight->done)) {
+			hash_algo = flight->result;
+			if (hash_algo >= 0)
+				memcpy(hash, &flight->hash, sizeof(*hash));
+		}
+		ima_inflight_put(flight);
+		atomic_inc(&ima_hash_joins);
+		ima_stage_hit(IMA_STAGE_FILE_HASH, true);
+		return hash_algo;
+	}
+
+	atomic_inc(&ima_hashes);
+	ima_stage_hit(IMA_STAGE_FILE_HASH, false);
+	start = ima_stage_start();
+	hash_algo = ima_hash_all(file, inode, version, algo, hash);
+
+	/* IMA's helpers also read files ima_hash_all leaves out */
+	if (hash_algo < 0 && algo == ima_hash_algo) {
+		hash_algo = ima_file_hash(file, hash->digest, 
+				sizeof(hash->digest));
+	} else if (hash_algo < 0) {
+		memset(hash, 0, sizeof(*hash));
+		hash->hdr.algo = algo;
+		hash->hdr.length = hash_digest_size[algo];
+		hash_algo = ima_calc_file_hash(file, &hash->hdr);
+		if (!hash_algo)
+			hash_algo = algo;
+	}
+	ima_stage_end(IMA_STAGE_FILE_HASH, start, hash_algo);
+	if (hash_algo >= 0) {
+		hash->hdr.algo = hash_algo;
+		hash->hdr.length = hash_digest_size[hash_algo];
+		ima_digest_insert(inode, version, &hash->hdr);
+	}
+
+	if (flight)
+		ima_inflight_finish(flight, hash_algo, hash);
+
+	return hash_algo;
+}
+
+/*
+ * ima_extra_digests
  * 	struct file *file: file measured
- * 	char *filename: name of measured file (ns:file path) 
- * 	int length: size of hash data
- * 	struct ima_template_desc *desc: description of IMA template
- * 	int hash_algo: algorithm used in measurement 
+ * 	struct inode *inode: backing inode of file
+ * 	u64 version: i_version sampled before hashing
+ * 	struct ima_max_digest_data *digest: measured file digest
+ * 	struct ima_file_digests *files: hash_algos digests (out)
  *
- * 	Store file with namespaced measurement and file name
- * 	Extend to pcr 11
+ * 	Collect the hash_algos digests of file from the measured
+ * 	digest and the digest store. Those missing, as when the
+ * 	measured digest came from host IMA, are computed in one
+ * 	pass.
  */
-noinline int ima_store_measurement(struct ima_max_digest_data *hash, 
-		struct file *file, char *filename, int length, 
-		struct ima_template_desc *desc, int hash_algo)
+static int ima_extra_digests(struct file *file, struct inode *inode, 
+		u64 version, struct ima_max_digest_data *digest, 
+		struct ima_file_digests *files)
 {
+	struct ima_file_digests *missing;
+	int i, j, check;
 
-	int i, check;
-	u64 i_version;
-	struct inode *inode;
-	struct ima_template_entry *entry;
-        struct integrity_iint_cache iint = {};
+	missing = kzalloc(sizeof(*missing), GFP_KERNEL);
+	if (!missing)
+		return -ENOMEM;
 
-	/* init inode integrity data */
-	inode = file->f_inode;
-	i_version = inode_query_iversion(inode);
+	files->count = ima_nr_algos;
+	for (i = 0; i < ima_nr_algos; i++) {
+		if (ima_algos[i] == digest->hdr.algo)
+			memcpy(&files->digest[i], digest, sizeof(*digest));
+		else if (!ima_digest_lookup(inode, ima_algos[i], 
+					&files->digest[i]))
+			missing->digest[missing->count++].hdr.algo = 
+				ima_algos[i];
+	}
 
-        iint.inode = inode;
-        iint.ima_hash = &hash->hdr;
-        iint.ima_hash->algo =  hash_algo;
-        iint.ima_hash->length = hash_digest_size[hash_algo];
-        iint.version = i_version;
-        
-	memcpy(hash->hdr.digest, hash->digest, sizeof(hash->digest));
+	check = 0;
+	if (!missing->count)
+		goto out;
 
-        memcpy(iint.ima_hash, hash, length);
-        
-	/* IMA event data */
-	struct ima_event_data event_data = { .iint = &iint,
-                                             .file = file,
-                                             .filename = filename
-                                           };
+	atomic_inc(&ima_hashes);
+	check = ima_multi_hash(file, missing);
+	if (check < 0)
+		goto out;
 
-	/* IMA template field data */
-        check = ima_alloc_init_template(&event_data, &entry, desc);
-        if (check < 0) {
-                return 0;
-        }
+	for (i = 0, j = 0; i < ima_nr_algos && j < missing->count; i++) {
+		if (ima_algos[i] != missing->digest[j].hdr.algo)
+			continue;
+		memcpy(&files->digest[i], &missing->digest[j], 
+				sizeof(files->digest[i]));
+		ima_digest_insert(inode, version, &missing->digest[j].hdr);
+		j++;
+	}
+out:
+	kfree(missing);
 
-	/* Store template, extend to PCR 11 */
-        check = ima_store_template(entry, 0, inode, filename, 11);
-        if ((!check || check == -EEXIST) && !(file->f_flags & O_DIRECT)) {
-                iint.flags |= IMA_MEASURED;
-                iint.measured_pcrs |= (0x1 << 11);
-                return 0;
-        }
+	return check;
+}
+
+/*
+ * fs-verity
+ * 	A verity file carries a digest of its Merkle tree, which
+ * 	the kernel returns without reading the file. Measurements
+ * 	of that digest use ima_verity_desc, verity_template when it
+ * 	could be resolved, so verifiers can tell them apart.
+ */
+static struct ima_template_desc *ima_verity_desc;
+
+/*
+ * ima_verity_digest
+ * 	struct inode *inode: backing inode of the file
+ * 	int algo: algorithm requested for the file digest
+ * 	struct ima_max_digest_data *hash: fs-verity digest (out)
+ *
+ * 	Returns true if inode has fs-verity enabled and its digest
+ * 	may stand in for a hash with algo. A container asking for
+ * 	an algorithm other than hash_algo or the verity one gets a
+ * 	full hash instead.
+ */
+static bool ima_verity_digest(struct inode *inode, int algo, 
+		struct ima_max_digest_data *hash)
+{
+	enum hash_algo verity_algo;
+	u8 fsverity_algo;
+	int size;
+
+	if (!verity || !IS_VERITY(inode))
+		return false;
+
+	size = fsverity_get_digest(inode, hash->digest, &fsverity_algo, 
+			&verity_algo);
+	if (size <= 0)
+		return false;
+	if (algo != ima_default_algo && algo != verity_algo)
+		return false;
+
+	hash->hdr.algo = verity_algo;
+	hash->hdr.length = size;
+	atomic_inc(&ima_verity_digests);
+	return true;
+}
+
+static void ima_verity_init(void)
+{
+	struct ima_template_desc *desc;
+
+	if (!lookup_template_desc || !template_desc_init_fields)
+		return;
 
-	/* Clean up if needed */
-        for (i = 0; i < entry->template_desc->num_fields; i++)
-                kfree(entry->template_data[i].data);
+	desc = lookup_template_desc(verity_template);
+	if (!desc) {
+		pr_warn("Template %s not found, verity measurements use the current template\n", 
+				verity_template);
+		return;
+	}
+
+	/* IMA only sets up fields of templates it has used */
+	if (!desc->fields && template_desc_init_fields(desc->fmt, 
+				&desc->fields, &desc->num_fields) < 0)
+		return;
+
+	ima_verity_desc = desc;
+}
+
+/*
+ * ima_ns_measurement
+ * 	struct ima_max_digest_data *digest: file digest
+ * 	unsigned int ns: namespace 
+ * 	struct ima_max_digest_data *hash: namespaced measurement (out)
+ *
+ * 	HASH(measurement || NS), NS in decimal, using the algorithm
+ * 	of the file digest
+ */
+static int ima_ns_measurement(struct ima_max_digest_data *digest, 
+		unsigned int ns, struct ima_max_digest_data *hash)
+{
+	u8 buf[HASH_MAX_DIGESTSIZE + 16];
+	int len, check;
+	u64 start;
+
+	len = ima_ns_buf(digest->digest, digest->hdr.length, ns, buf);
+
+	hash->hdr.algo = digest->hdr.algo;
+	hash->hdr.length = digest->hdr.length;
+	memset(&hash->digest, 0, sizeof(hash->digest));
 
-        kfree(entry->digests);
-        kfree(entry);
+	start = ima_stage_start();
+	check = ima_calc_buffer_hash(buf, len, &hash->hdr);
+	ima_stage_end(IMA_STAGE_BUFFER_HASH, start, check);
 
 	return check;
 }
 
 /*
- * ima_file_measure
+ * ima_ns_path
+ * 	struct file *file: file measured
+ * 	unsigned int ns: namespace 
+ * 	char *buf: PATH_MAX buffer from __getname
+ *
+ * 	Format ns:file_path in buf. d_absolute_path builds the path
+ * 	at the end of buf and the prefix goes right in front of it,
+ * 	so long container paths are neither copied nor truncated.
+ * 	Files without an absolute path (pseudo or unreachable ones)
+ * 	return an error and are not measured.
+ */
+static char *ima_ns_path(struct file *file, unsigned int ns, char *buf)
+{
+	char prefix[12];
+	char *path;
+	int len;
+
+	len = scnprintf(prefix, sizeof(prefix), "%u:", ns);
+	path = d_absolute_path(&file->f_path, buf + len, PATH_MAX - len);
+	if (IS_ERR(path))
+		return path;
+
+	path -= len;
+	memcpy(path, prefix, len);
+
+	return path;
+}
+
+/*
+ * __ima_file_measure
  * 	struct file *file: file to be measured
  * 	unsigned int ns: namespace 
  * 	struct ima_template_desc *decs: description of IMA template
+ * 	int algo: file hash algorithm
+ * 	struct ebpf_data *data: receives the new measurement, or NULL
  * 	
- * 	Measures file using ima_file_hash 
+ * 	Measures file with algo, or its fs-verity digest when it
+ * 	has one, see ima_file_digest
+ * 	The hash_algos digests of other files are logged with the
+ * 	namespace record
  * 	Namespaced measurements are as follows
  * 		HASH(measurement || NS) 
- * 	Measurements are logged with the format NS:file_path 
+ * 	Measurements are logged with the format NS:file_path, see
+ * 	ima_ns_path
+ * 	Files already measured for NS with algo at their current
+ * 	i_version are skipped, see ima_cache_lookup. Caching is keyed by the
+ * 	backing inode so overlay mounts of one layer share entries.
+ *
+ * 	Returns IMA_NS_MEASURED once file is measured for NS and may
+ * 	be skipped until it changes, 0 otherwise
  */
-noinline int ima_file_measure(struct file *file, unsigned int ns, 
-		struct ima_template_desc *desc)
+static int __ima_file_measure(struct file *file, unsigned int ns, 
+		struct ima_template_desc *desc, int algo, 
+		struct ebpf_data *data)
 {
-        int check, length, hash_algo;
-	char buf[64];
-	char *extend;
-	char *path;
-	char filename[128];
-	char ns_buf[128];
+        int check, length, hash_algo, ret = 0;
+	u64 i_version;
+	char *buf = NULL, *filename;
+	bool verity_digest;
+	struct inode *inode = ima_real_inode(file);
+	struct ima_file_digests *files = NULL;
+        struct ima_max_digest_data digest;
         struct ima_max_digest_data hash;
+	u64 start;
 
+	if (ima_cache_lookup(inode, ns, algo)) {
+		ima_stage_hit(IMA_STAGE_MEASURE, true);
+		return IMA_NS_MEASURED;
+	}
+	ima_stage_hit(IMA_STAGE_MEASURE, false);
 
-	/* Measure file */
-        hash_algo = ima_file_hash(file, buf, sizeof(buf));
+	/* Sample before hashing so a racing write invalidates the entry */
+	i_version = inode_query_iversion(inode);
 
-	path = ima_d_path(&file->f_path, &path, filename);
-	if (!path) {
-		return 0;
+	/* Measure file, or reuse the digest of another namespace */
+	verity_digest = ima_verity_digest(inode, algo, &digest);
+	if (verity_digest) {
+		hash_algo = digest.hdr.algo;
+		if (ima_verity_desc)
+			desc = ima_verity_desc;
+	} else {
+		hash_algo = ima_file_digest(file, inode, i_version, algo, 
+				&digest);
 	}
-	
-	/* Catch all for policy errors, todo */
-	if (path[0] != '/')
+	if (hash_algo < 0)
 		return 0;
 
-	sprintf(ns_buf, "%u", ns);
-	sprintf(filename, "%u:%s", ns, path);
-	
-	extend = strncat(buf, ns_buf, 32);
-
-	hash.hdr.length = hash_digest_size[hash_algo]; 
-        hash.hdr.algo =  hash_algo;
-        memset(&hash.digest, 0, sizeof(hash.digest));
+	start = ima_stage_start();
+	buf = __getname();
+	filename = buf ? ima_ns_path(file, ns, buf) : ERR_PTR(-ENOMEM);
+	ima_stage_end(IMA_STAGE_D_PATH, start, PTR_ERR_OR_ZERO(filename));
+	if (IS_ERR(filename))
+		goto out;
 
-	length = sizeof(hash.hdr) + hash.hdr.length;
+	length = sizeof(hash.hdr) + hash_digest_size[hash_algo];
 	
 	/* Final measurement:
-	 * HASH(measurement || NS) 
-	 * Concatenate file measurement with the NS buffer
-	 * Hash the concatonated string */	
-	check = ima_calc_buffer_hash(extend, sizeof(extend), &hash.hdr);
+	 * HASH(measurement || NS) */
+	check = ima_ns_measurement(&digest, ns, &hash);
 	if (check < 0)
-		return 0;
+		goto out;
+
+	/* Verity files are measured without reading them */
+	if (ima_nr_algos && !verity_digest) {
+		files = kzalloc(sizeof(*files), GFP_KERNEL);
+		if (files && ima_extra_digests(file, inode, i_version, 
+					&digest, files) < 0) {
+			kfree(files);
+			files = NULL;
+		}
+	}
 	
-	check = ima_store_measurement(&hash, file, filename, length, 
-			desc, hash_algo);
+	check = __ima_store_measurement(&hash, file, filename, length, 
+			desc, hash_algo, ns, &digest.hdr, verity_digest, 
+			files);
+	kfree(files);
+	if (check)
+		goto out;
+
+	if (data) {
+		data->algo = hash.hdr.algo;
+		data->digest_len = hash.hdr.length;
+		data->flags = verity_digest ? IMA_EVENT_VERITY : 0;
+		memcpy(data->digest, hash.digest, hash.hdr.length);
+		/* The event carries the whole array, never an older digest */
+		memset(data->digest + hash.hdr.length, 0,
+				sizeof(data->digest) - hash.hdr.length);
+	}
+
+	if (file->f_flags & O_DIRECT)
+		goto out;
+
+	ima_cache_insert(inode, i_version, ns, algo);
+	ret = IMA_NS_MEASURED;
+out:
+	if (buf)
+		__putname(buf);
+
+	return ret;
+}
+
+/*
+ * ima_file_measure
+ * 	struct file *file: file to be measured
+ * 	unsigned int ns: namespace 
+ * 	struct ima_template_desc *decs: description of IMA template
+ *
+ * 	See __ima_file_measure
+ */
+noinline int ima_file_measure(struct file *file, unsigned int ns, 
+		struct ima_template_desc *desc)
+{
+	return __ima_file_measure(file, ns, desc, ima_default_algo, NULL);
+}
+
+/*
+ * Asynchronous measurement
+ * 	The mmap hook queues a file reference on a bounded per-CPU
+ * 	list and returns. Each CPU's work item drains its list on
+ * 	the module workqueue, hashing and storing in the background.
+ */
+static DEFINE_PER_CPU(struct ima_async_queue, ima_async_queues);
+static struct dentry *ima_debugfs_dir;
+static atomic_t ima_async_queued = ATOMIC_INIT(0);
+static atomic_t ima_async_drops = ATOMIC_INIT(0);
+static atomic_t ima_async_sync_fallbacks = ATOMIC_INIT(0);
+
+static void ima_async_work(struct work_struct *work)
+{
+	struct ima_async_queue *queue = container_of(work, 
+			struct ima_async_queue, work);
+	struct ima_async_item *item, *tmp;
+	struct llist_node *items;
+
+	items = llist_reverse_order(llist_del_all(&queue->items));
+	llist_for_each_entry_safe(item, tmp, items, node) {
+		__ima_file_measure(item->file, item->ns, item->desc, 
+				item->hash_algo, NULL);
+		fput(item->file);
+		atomic_dec(&queue->depth);
+		kfree(item);
+	}
+}
+
+/*
+ * ima_async_measure
+ * 	struct file *file: file to be measured
+ * 	unsigned int ns: namespace 
+ * 	struct ima_template_desc *desc: description of IMA template
+ * 	int algo: file hash algorithm
+ *
+ * 	Queue file for measurement. Returns -EBUSY when the local
+ * 	queue is full and the caller should fall back, 0 otherwise.
+ */
+static int ima_async_measure(struct file *file, unsigned int ns, 
+		struct ima_template_desc *desc, int algo)
+{
+	struct ima_async_queue *queue;
+	struct ima_async_item *item;
+	int cpu;
+
+	item = kmalloc(sizeof(*item), GFP_KERNEL);
+	if (!item)
+		return -EBUSY;
+
+	cpu = raw_smp_processor_id();
+	queue = per_cpu_ptr(&ima_async_queues, cpu);
+	if (atomic_inc_return(&queue->depth) > async_queue_depth) {
+		atomic_dec(&queue->depth);
+		kfree(item);
+		return -EBUSY;
+	}
+
+	item->file = get_file(file);
+	item->ns = ns;
+	item->desc = desc;
+	item->hash_algo = algo;
+	llist_add(&item->node, &queue->items);
+	atomic_inc(&ima_async_queued);
+	queue_work_on(cpu, ima_async_wq, &queue->work);
+
+	return 0;
+}
+
+static int ima_async_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ima_async_queue *queue = per_cpu_ptr(&ima_async_queues, 
+				cpu);
+
+		init_llist_head(&queue->items);
+		atomic_set(&queue->depth, 0);
+		INIT_WORK(&queue->work, ima_async_work);
+	}
+
+	ima_async_wq = alloc_workqueue("container_ima", WQ_MEM_RECLAIM, 0);
+	if (!ima_async_wq)
+		return -ENOMEM;
 
 	return 0;
 }
 
+static void ima_debugfs_init(void)
+{
+	ima_debugfs_dir = debugfs_create_dir("container_ima", NULL);
+	debugfs_create_atomic_t("async_queued", 0444, ima_debugfs_dir, 
+			&ima_async_queued);
+	debugfs_create_atomic_t("async_drops", 0444, ima_debugfs_dir, 
+			&ima_async_drops);
+	debugfs_create_atomic_t("async_sync_fallbacks", 0444, 
+			ima_debugfs_dir, &ima_async_sync_fallbacks);
+	debugfs_create_atomic_t("hashes", 0444, ima_debugfs_dir, 
+			&ima_hashes);
+	debugfs_create_atomic_t("hash_joins", 0444, ima_debugfs_dir, 
+			&ima_hash_joins);
+	debugfs_create_atomic_t("verity_digests", 0444, ima_debugfs_dir, 
+			&ima_verity_digests);
+	debugfs_create_atomic_t("iint_reuses", 0444, ima_debugfs_dir, 
+			&ima_iint_reuses);
+	debugfs_create_atomic_t("ahashes", 0444, ima_debugfs_dir, 
+			&ima_ahashes);
+	debugfs_create_file("drivers", 0444, ima_debugfs_dir, NULL, 
+			&ima_drivers_fops);
+	debugfs_create_file("stats", 0444, ima_debugfs_dir, NULL, 
+			&ima_stats_fops);
+	debugfs_create_file("memory", 0444, ima_debugfs_dir, NULL, 
+			&ima_memory_fops);
+	/* excluded by the probe's namespace filter */
+	debugfs_create_u32("host_ns", 0444, ima_debugfs_dir, &host_inum);
+}
+
 /*
- * bpf_process_measurement 
+ * __bpf_process_measurement 
  * 	void *mem: pointer to struct ebpf_data to allow though verifier
- * 	int mem__sz: size of pointer 
  *
  * 	Function gets action from ima policy, measures, and stores
- * 	accordingly.
- * 	Exported by libbpf, called by eBPF program hooked to LSM (mmap_file)
+ * 	accordingly. Containers whose probe policy is
+ * 	IMA_POLICY_MEASURE skip the IMA policy and are measured
+ * 	with their own hash algorithm.
+ * 	The IMA policy sees the credentials and LSM label of
+ * 	data->subject when set: probe --scan maps the files of that
+ * 	process, and its rules must match as for the process itself.
+ * 	Returns IMA_NS_MEASURED when the caller may remember the file
+ * 	as measured for its namespace (see inode_ns_map in probe.bpf.c)
+ * 	A new synchronous measurement is copied back into mem for the
+ * 	probe's event stream, digest_len is 0 otherwise
  */
-noinline int bpf_process_measurement(void *mem, int mem__sz)
+static int __bpf_process_measurement(void *mem)
 {
 
 	int ret, action, pcr;
 	struct inode *inode;
 	struct mnt_idmap *idmap;
 	const struct cred *cred;
+	struct task_struct *task;
 	u32 secid;
 	struct ima_template_desc *desc = NULL;
 	unsigned int allowed_algos = 0;
 	struct ebpf_data *data = (struct ebpf_data *) mem;
-	struct file *file = data->file;
-	unsigned int ns = data->ns;
+	struct file *file;
+	unsigned int ns;
+	int hash_algo = ima_default_algo;
+	enum ima_hooks func;
 	
+	file = data->file;
+	ns = data->ns;
+	data->digest_len = 0;
 	if (!file)
 		return 0;
 	
@@ -203,33 +3087,119 @@ noinline int bpf_process_measurement(void *mem, int mem__sz)
 	if (!S_ISREG(inode->i_mode))
                 return 0;
 
+	/* Container opted in, the host policy is not consulted */
+	if (data->policy == IMA_POLICY_MEASURE) {
+		action = IMA_MEASURE;
+		if (data->hash_algo < HASH_ALGO__LAST)
+			hash_algo = data->hash_algo;
+		goto measure;
+	}
 
-	security_current_getsecid_subj(&secid);
-
-	cred = current_cred();
-	if (!cred)
-		return 0;
+	if (data->subject) {
+		rcu_read_lock();
+		task = get_pid_task(find_vpid(data->subject), PIDTYPE_PID);
+		rcu_read_unlock();
+		/* Gone, its rules cannot be evaluated */
+		if (!task)
+			return 0;
+		security_task_getsecid_obj(task, &secid);
+		cred = get_task_cred(task);
+		put_task_struct(task);
+	} else {
+		security_current_getsecid_subj(&secid);
+		cred = get_current_cred();
+	}
 
 	idmap = file->f_path.mnt->mnt_idmap; 
 
-	/* Get action form IMA policy */
+	/* Get action form IMA policy, executables get BPRM_CHECK rules */
+	func = data->hook == IMA_HOOK_BPRM ? BPRM_CHECK : MMAP_CHECK;
 	pcr = 10;
-	action = ima_get_action(idmap, inode, cred, secid, 
-			MAY_EXEC, MMAP_CHECK, &pcr, &desc, 
-			NULL, &allowed_algos);
+	action = ima_get_action_cached(idmap, inode, cred, secid, 
+			MAY_EXEC, func, &pcr, &desc, 
+			&allowed_algos);
+	put_cred(cred);
 	if (!action)  
 		return 0;
 	
 	
-	if (action & IMA_MEASURE)
-		ret =  ima_file_measure(file, ns, desc);
+	if (!(action & IMA_MEASURE))
+		return 0;
+
+measure:
+	/* Appraisal must complete before the mapping is allowed */
+	if (async_mode && !(action & IMA_APPRAISE)) {
+		if (!ima_async_measure(file, ns, desc, hash_algo))
+			return 0;
+		if (async_overflow == IMA_ASYNC_OVERFLOW_DROP) {
+			atomic_inc(&ima_async_drops);
+			return 0;
+		}
+		atomic_inc(&ima_async_sync_fallbacks);
+	}
+
+	ret =  __ima_file_measure(file, ns, desc, hash_algo, data);
 
 	
+	return ret;
+}
+
+/*
+ * bpf_process_measurement 
+ * 	void *mem: pointer to struct ebpf_data to allow though verifier
+ * 	int mem__sz: size of struct ebpf_data
+ *
+ * 	Exported by libbpf, called by eBPF program hooked to LSM (mmap_file)
+ * 	Timed wrapper around __bpf_process_measurement
+ */
+noinline int bpf_process_measurement(void *mem, int mem__sz)
+{
+	int ret;
+	u64 start;
+
+	if (mem__sz < sizeof(struct ebpf_data))
+		return 0;
+
+	start = ima_stage_start();
+	ret = __bpf_process_measurement(mem);
+	ima_stage_end(IMA_STAGE_MMAP, start, ret);
+
+	return ret;
+}
+
+/*
+ * bpf_file_version
+ * 	struct file *file: file being mapped
+ * 	void *mem: struct file_version (out)
+ * 	int mem__sz: size of struct file_version
+ *
+ * 	Identity and i_version of the inode holding the contents of
+ * 	file. Overlay inodes have no i_version of their own, this
+ * 	lets the probe's fast path recognize container files without
+ * 	calling bpf_process_measurement.
+ * 	Returns 0 if the version tracks writes, -EINVAL otherwise.
+ */
+noinline int bpf_file_version(struct file *file, void *mem, int mem__sz)
+{
+	struct file_version *ver = (struct file_version *) mem;
+	struct inode *inode;
+
+	if (mem__sz < sizeof(*ver))
+		return -EINVAL;
+
+	inode = ima_real_inode(file);
+	ver->ino = inode->i_ino;
+	ver->dev = inode->i_sb->s_dev;
+	if (!ima_cache_usable(inode))
+		return -EINVAL;
+	ver->version = inode_peek_iversion(inode);
+
 	return 0;
 }
 
 BTF_SET8_START(ima_kfunc_ids)
 BTF_ID_FLAGS(func, bpf_process_measurement, KF_TRUSTED_ARGS | KF_SLEEPABLE)
+BTF_ID_FLAGS(func, bpf_file_version, KF_TRUSTED_ARGS)
 BTF_ID_FLAGS(func,  ima_file_measure, KF_TRUSTED_ARGS | KF_SLEEPABLE)
 BTF_ID_FLAGS(func,  ima_store_measurement, KF_TRUSTED_ARGS | KF_SLEEPABLE)
 BTF_SET8_END(ima_kfunc_ids)
@@ -243,13 +3213,14 @@ static int container_ima_init(void)
 
 	/* Start container IMA */
 	int ret;
+	int *hash_algo_addr;
 	struct task_struct *task;
 	
 	pr_info("Starting Container IMA\n");
 
 
 	task = current;
-	host_inum = task->nsproxy->cgroup_ns->ns.inum;
+	host_inum = task->nsproxy->uts_ns->ns.inum;
 	
 	/* Register kernel module functions wiht libbpf */
 	ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_LSM, &bpf_ima_kfunc_set);
@@ -306,13 +3277,6 @@ static int container_ima_init(void)
                 return -1;
         }
 
-	ima_d_path = (const char *(*)(const struct path *, char **, 
-				char *)) kallsyms_lookup_name("ima_d_path");
-        if (ima_d_path == 0) {
-                pr_err("Lookup fails\n");
-                return -1;
-        }
-	
 	ima_get_action = (int (*)(struct mnt_idmap *, struct inode *, 
 				const struct cred *, u32,  int,  
 				enum ima_hooks,  int *, 
@@ -325,12 +3289,35 @@ static int container_ima_init(void)
                 return -1;
         }
 	
-	ima_hash_algo = (int) kallsyms_lookup_name("ima_hash_algo");
+	ima_calc_file_hash = (int (*)(struct file *, 
+				struct ima_digest_data *)) 
+		kallsyms_lookup_name("ima_calc_file_hash");
+	if (ima_calc_file_hash == 0) {
+		pr_err("Lookup fails\n");
+		return -1;
+	}
+
+	/* Optional, without it every file is hashed by the module */
+	integrity_iint_find = (struct integrity_iint_cache *(*)(
+				struct inode *)) 
+		kallsyms_lookup_name("integrity_iint_find");
+
+	/* Optional, without them verity measurements keep the policy's 
+	 * template */
+	lookup_template_desc = (struct ima_template_desc *(*)(const char *)) 
+		kallsyms_lookup_name("lookup_template_desc");
+	template_desc_init_fields = (int (*)(const char *, 
+				const struct ima_template_field ***, int *)) 
+		kallsyms_lookup_name("template_desc_init_fields");
+	ima_verity_init();
+
+	hash_algo_addr = (int *) kallsyms_lookup_name("ima_hash_algo");
 
-	if (ima_hash_algo == 0) {
+	if (hash_algo_addr == 0) {
 		pr_err("Lookup fails\n");
 		return -1;
 	}
+	ima_hash_algo = *hash_algo_addr;
 
 	ima_calc_field_array_hash = (int (*)(struct ima_field_data *,
 			      struct ima_template_entry *)) 
@@ -341,12 +3328,86 @@ static int container_ima_init(void)
                 return -1;
         }
 
+	ret = ima_hash_algos_init();
+	if (ret < 0)
+		goto out_algos;
+
+	ret = ima_slab_init(ima_nr_algos);
+	if (ret < 0) {
+		pr_err("Failed to create slab caches\n");
+		goto out_algos;
+	}
+
+	ret = ima_intern_init();
+	if (ret < 0) {
+		pr_err("Failed to allocate intern tables\n");
+		goto out_slab;
+	}
+
+	ret = ima_async_init();
+	if (ret < 0) {
+		pr_err("Failed to allocate workqueue\n");
+		goto out_intern;
+	}
+
+	ret = ima_vpcr_init();
+	if (ret < 0) {
+		pr_err("Failed to allocate vPCR hash\n");
+		goto out_wq;
+	}
+
+	ret = ima_securityfs_init();
+	if (ret < 0) {
+		pr_err("Failed to create securityfs files\n");
+		goto out_vpcr;
+	}
+
+	/* Drop cached measurements when inodes are freed */
+	ret = register_kprobe(&inode_free_kp);
+	if (ret < 0) {
+		pr_err("Failed to register inode free probe\n");
+		goto out_securityfs;
+	}
+
+	ima_policy_cache_init();
+	ima_debugfs_init();
+
+	return ret;
+
+out_securityfs:
+	ima_securityfs_exit();
+out_vpcr:
+	ima_vpcr_exit();
+out_wq:
+	destroy_workqueue(ima_async_wq);
+out_intern:
+	ima_intern_exit();
+out_slab:
+	ima_slab_exit();
+out_algos:
+	ima_hash_algos_exit();
 	return ret;
 }
 
 static void container_ima_exit(void)
 {
 	pr_info("Exiting Container IMA\n");
+
+	debugfs_remove_recursive(ima_debugfs_dir);
+	ima_securityfs_exit();
+
+	/* Pending async measurements may still log to namespaces */
+	flush_workqueue(ima_async_wq);
+	ima_vpcr_exit();
+	destroy_workqueue(ima_async_wq);
+	ima_intern_exit();
+	ima_hash_algos_exit();
+
+	unregister_kprobe(&inode_free_kp);
+	ima_policy_cache_exit();
+	ima_cache_flush();
+	rcu_barrier();
+	ima_slab_exit();
 	return;
 }
 
@@ -22,7 +22,16 @@
 #include <linux/tpm_command.h>
 #include <linux/file.h>
 #include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/refcount.h>
+#include <linux/rhashtable.h>
 #include <crypto/hash.h>
+#include <crypto/sha2.h>
 
 /* digest size for IMA, fits SHA1 or MD5 */
 #define IMA_DIGEST_SIZE		SHA1_DIGEST_SIZE
@@ -49,6 +58,7 @@
 #define IMA_NEW_FILE		0x04000000
 #define EVM_IMMUTABLE_DIGSIG	0x08000000
 #define IMA_FAIL_UNVERIFIABLE_SIGS	0x10000000
+#define IMA_VERITY_REQUIRED	0x80000000
 
 #define IMA_DO_MASK		(IMA_MEASURE | IMA_APPRAISE | IMA_AUDIT | \
 				 IMA_HASH | IMA_APPRAISE_SUBMASK)
@@ -254,17 +264,303 @@ struct integrity_iint_cache {
 struct ebpf_data {
         struct file *file;
         unsigned int ns;
+	u32 subject;			/* pid for probe --scan, 0: current */
+	/* per-container policy from the probe's container_policy map */
+	u8 policy;			/* IMA_POLICY_* */
+	u8 hash_algo;			/* IMA_POLICY_MEASURE, invalid: IMA's */
+	u8 hook;			/* IMA_HOOK_* */
+	/* set by bpf_process_measurement for a new measurement */
+	u8 algo;
+	u8 digest_len;
+	u8 flags;			/* IMA_EVENT_* */
+	u8 digest[HASH_MAX_DIGESTSIZE];
+};
+
+/*
+ * bpf_file_version result: the inode holding the file contents,
+ * the backing inode for overlay files
+ */
+struct file_version {
+	u64 version;			/* i_version, if the call returned 0 */
+	u64 ino;
+	u32 dev;
+	u32 pad;
 };
 
+/* ebpf_data flags */
+#define IMA_EVENT_VERITY 0x01		/* measured the fs-verity digest */
+
+/* bpf_process_measurement: file is measured for the namespace */
+#define IMA_NS_MEASURED 1
+
+/* ebpf_data policy: host IMA policy, or measure regardless of it */
+#define IMA_POLICY_HOST 0
+#define IMA_POLICY_MEASURE 1
+
+/* ebpf_data hook: LSM hook of the probe program calling in */
+#define IMA_HOOK_MMAP 0			/* mmap_file, MMAP_CHECK rules */
+#define IMA_HOOK_BPRM 1			/* bprm_check_security, BPRM_CHECK */
+
+/* async_overflow: what to do when the per-CPU queue is full */
+#define IMA_ASYNC_OVERFLOW_SYNC	0
+#define IMA_ASYNC_OVERFLOW_DROP	1
+
+/* per-CPU bounded queue of pending measurements */
+struct ima_async_queue {
+	struct llist_head items;
+	atomic_t depth;
+	struct work_struct work;
+};
+
+/* one pending measurement, holds a reference on file */
+struct ima_async_item {
+	struct llist_node node;
+	struct file *file;
+	unsigned int ns;
+	struct ima_template_desc *desc;
+	int hash_algo;
+};
+
+/* hash_algos: file digests computed in the same pass */
+#define IMA_MAX_ALGOS 4
+#define IMA_HASH_CHUNK (64 * 1024)
+#define IMA_AHASH_CHUNK (256 * 1024)	/* two in flight, see ima_multi_ahash */
+
 struct ima_max_digest_data {
         struct ima_digest_data hdr;
         u8 digest[HASH_MAX_DIGESTSIZE];
 } __packed;
 
+/* measurement cache, see ima_cache_lookup() */
+#define IMA_CACHE_BITS 10
+
+/* per-inode cache state, dropped when the inode changes or is freed */
+struct ima_inode_cache {
+	struct hlist_node hnode;	/* in ima_inode_htable, keyed by inode */
+	struct rcu_head rcu;
+	struct inode *inode;
+	u64 version;			/* i_version when measured */
+	struct hlist_head ns_entries;	/* struct ima_ns_cache */
+	struct list_head digests;	/* struct ima_cached_digest */
+};
+
+/* file digests of one pass, hash_algos plus the measured one */
+struct ima_file_digests {
+	int count;
+	struct ima_max_digest_data digest[IMA_MAX_ALGOS + 1];
+};
+
+/* measurement stages with latency histograms, see ima_stage_end() */
+enum ima_stage {
+	IMA_STAGE_MMAP,			/* whole bpf_process_measurement */
+	IMA_STAGE_GET_ACTION,		/* hit: policy decision cached */
+	IMA_STAGE_MEASURE,		/* hit: (inode, ns) already measured */
+	IMA_STAGE_FILE_HASH,		/* hit: file digest reused */
+	IMA_STAGE_D_PATH,
+	IMA_STAGE_BUFFER_HASH,
+	IMA_STAGE_ALLOC_TEMPLATE,
+	IMA_STAGE_STORE_TEMPLATE,
+	IMA_STAGE_MAX
+};
+
+#define IMA_HIST_BUCKETS 32
+
+struct ima_stage_stats {
+	u64 hits;
+	u64 misses;
+	u64 errors;
+	u64 hist[IMA_HIST_BUCKETS];
+};
+
+/* PCR extended with container measurements */
+#define IMA_CONTAINER_PCR 11
+
+/* per-namespace logs and vPCRs, see ima_ns_record() */
+#define IMA_NAMESPACE_BITS 8
+#define IMA_VPCR_NAME "container-ima-vpcr"
+
+struct ima_namespace {
+	struct hlist_node hnode;	/* in ima_namespace_htable */
+	struct rcu_head rcu;
+	unsigned int ns;
+	struct llist_head incoming;	/* appended, not yet in the log */
+	atomic_t queued;		/* appended since the last TPM extend */
+	spinlock_t lock;		/* protects everything below */
+	u8 vpcr[SHA256_DIGEST_SIZE];
+	u64 count;			/* records ever logged */
+	u64 pending;			/* records since last TPM extend */
+	u64 finalized;			/* records covered by the TPM */
+	u64 trimmed;			/* records exported and freed */
+	struct list_head records;	/* struct ima_ns_record */
+};
+
+/* securityfs export read buffer, enough for a few records */
+#define IMA_EXPORT_BUF (64*1024)
+
+/*
+ * securityfs export record, struct export_record in probe.h.
+ * Followed by nr_files struct ima_export_digest and the
+ * NUL-terminated path, padded to a multiple of 8 bytes.
+ */
+struct ima_export_digest {
+	u8 algo;
+	u8 length;
+	u8 digest[HASH_MAX_DIGESTSIZE];
+};
+
+struct ima_export_record {
+	u32 size;			/* of the whole record */
+	u32 ns;
+	u64 epoch;			/* random, new vPCRs at each load */
+	u64 seq;
+	u8 template_digest[SHA256_DIGEST_SIZE];
+	u8 algo;
+	u8 length;
+	u8 flags;			/* IMA_EXPORT_* */
+	u8 nr_files;
+	u16 path_len;			/* without the NUL */
+	u16 pad;
+	u8 digest[HASH_MAX_DIGESTSIZE];	/* namespaced measurement */
+};
+
+/* ima_export_record flags */
+#define IMA_EXPORT_VERITY 0x01		/* of the fs-verity digest */
+
+/*
+ * IMA_IOC_NS_READ, on the securityfs export file: the records of
+ * one namespace from seq, as struct ima_export_record. Matches
+ * struct ns_read in probe.h.
+ */
+struct ima_ns_read {
+	u32 ns;
+	u32 count;			/* records returned (out) */
+	u64 seq;			/* first wanted, then next (in/out) */
+	u64 buf;			/* user buffer */
+	u32 len;			/* of buf */
+	u32 pad;
+};
+
+#define IMA_IOC_MAGIC 0xCA
+#define IMA_IOC_NS_READ _IOWR(IMA_IOC_MAGIC, 1, struct ima_ns_read)
+
+/* securityfs export reader position */
+struct ima_export_cursor {
+	u64 ns;				/* u64, so it steps past U32_MAX */
+	u64 seq;
+};
+
+/* interned file digest, see ima_digest_intern() */
+struct ima_digest_key {
+	u8 algo;
+	u8 length;
+	u8 digest[HASH_MAX_DIGESTSIZE];	/* zero-padded */
+};
+
+struct ima_digest_ref {
+	struct rhash_head node;		/* in ima_digest_table */
+	struct rcu_head rcu;
+	refcount_t ref;
+	struct ima_digest_key key;
+};
+
+/* interned file path, see ima_path_intern() */
+struct ima_path_key {
+	const char *path;
+	u32 len;
+};
+
+struct ima_path_ref {
+	struct rhash_head node;		/* in ima_path_table */
+	struct rcu_head rcu;
+	refcount_t ref;
+	u32 len;
+	char path[];			/* without the ns: prefix */
+};
+
+struct ima_ns_record {
+	struct llist_node node;		/* in ima_namespace.incoming */
+	struct list_head list;
+	u64 seq;			/* position in the namespace log */
+	u8 template_digest[SHA256_DIGEST_SIZE];
+	bool verity;			/* of the fs-verity digest */
+	bool namespaced;		/* digest is already namespaced */
+	struct ima_digest_ref *digest;	/* file digest */
+	struct ima_path_ref *path;
+	int nr_files;
+	struct ima_digest_ref *files[];	/* hash_algos file digests */
+};
+
+/* policy decision cache, see ima_get_action_cached() */
+#define IMA_POLICY_CACHE_BITS 8
+
+/* everything an mmap rule can match on, compared with memcmp */
+struct ima_policy_key {
+	struct super_block *sb;
+	unsigned long magic;		/* sb may be freed and reused */
+	dev_t dev;
+	uuid_t uuid;
+	struct mnt_idmap *idmap;
+	kuid_t fowner;
+	kgid_t fgroup;
+	kuid_t uid;
+	kuid_t euid;
+	kgid_t gid;
+	kgid_t egid;
+	u32 secid;
+	u32 osecid;
+	int mask;
+	int func;
+};
+
+struct ima_policy_cache {
+	struct hlist_node hnode;	/* in ima_policy_htable */
+	struct rcu_head rcu;
+	struct ima_policy_key key;
+	int generation;
+	int action;
+	int pcr;
+	struct ima_template_desc *desc;
+	unsigned int allowed_algos;
+};
+
+/* file hash in progress, see ima_inflight_start() */
+#define IMA_INFLIGHT_BITS 6
+
+struct ima_inflight {
+	struct hlist_node hnode;	/* in ima_inflight_htable */
+	struct inode *inode;
+	u64 version;
+	int algo;
+	refcount_t ref;
+	struct completion done;
+	int result;			/* hash algorithm or -errno */
+	struct ima_max_digest_data hash;
+};
+
+/* file digest of one inode version, shared by all namespaces */
+struct ima_cached_digest {
+	struct list_head list;
+	struct rcu_head rcu;
+	u8 algo;
+	u8 length;
+	u8 digest[HASH_MAX_DIGESTSIZE];
+};
+
+/* one (inode, namespace, algorithm) that has already been measured */
+struct ima_ns_cache {
+	struct hlist_node hnode;	/* in ima_ns_htable, inode ^ ns ^ algo */
+	struct hlist_node inode_node;	/* in ima_inode_cache.ns_entries */
+	struct rcu_head rcu;
+	struct ima_inode_cache *icache;
+	unsigned int ns;
+	u8 algo;
+};
+
 static struct kprobe kp = {
     .symbol_name = "kallsyms_lookup_name"
 };
 
+/* uts namespace of the loading task, mmap_hook's ns for the host */
 unsigned int host_inum;
 
 extern int register_btf_kfunc_id_set(enum bpf_prog_type prog_type,
@@ -279,8 +575,6 @@ int (*ima_add_template_entry)(struct ima_template_entry *entry,
 int (*ima_calc_field_array_hash)(struct ima_field_data *field_data,
                               struct ima_template_entry *entry);
 
-const char *(*ima_d_path)(const struct path *, char **, char *);
-
 int (*ima_alloc_init_template)(struct ima_event_data *, 
 		struct ima_template_entry **, struct ima_template_desc *);
 
@@ -295,6 +589,15 @@ int ima_hash_algo;
 
 int ima_policy_flag;
 
+int (*ima_calc_file_hash)(struct file *, struct ima_digest_data *);
+
+struct ima_template_desc *(*lookup_template_desc)(const char *name);
+
+struct integrity_iint_cache *(*integrity_iint_find)(struct inode *inode);
+
+int (*template_desc_init_fields)(const char *template_fmt, 
+		const struct ima_template_field ***fields, int *num_fields);
+
 int (*ima_calc_buffer_hash)(const void *, loff_t len, 
 		struct ima_digest_data *); 
 
@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+# overlay_test.sh
+# 	Check that containers sharing an image layer hash its
+# 	files once
+#
+# Usage: overlay_test.sh [PROBE]
+# 	Mounts two overlays over one lower directory, as a container
+# 	runtime does for two containers of one image, and executes a
+# 	new file of that layer from two UTS namespaces, once through
+# 	each overlay. Both namespaces must log the file while
+# 	debugfs container_ima/hashes grows by exactly 1.
+#
+# 	Needs root, container_ima.ko loaded, overlayfs, unshare and
+# 	nsenter. PROBE (default ./probe) is started for the test; no
+# 	other probe may be running. DIR must be on a filesystem
+# 	with i_version, such as ext4 or xfs.
+#
+# Environment:
+# 	DIR		scratch directory, default /var/tmp/ima-overlay
+#
+set -eu
+
+PROBE=${1:-./probe}
+DIR=${DIR:-/var/tmp/ima-overlay}
+DEBUGFS=/sys/kernel/debug/container_ima
+SECURITYFS=/sys/kernel/security/container_ima
+REUSE_IINT=/sys/module/container_ima/parameters/reuse_iint
+
+probe_pid=
+holders=
+reuse_iint=
+
+cleanup() {
+	for pid in $holders; do
+		"$PROBE" policy del "pid:$pid" 2>/dev/null || true
+		kill "$pid" 2>/dev/null || true
+	done
+	[ -z "$probe_pid" ] || kill -INT "$probe_pid" 2>/dev/null || true
+	wait 2>/dev/null || true
+	umount "$DIR/merged1" 2>/dev/null || true
+	umount "$DIR/merged2" 2>/dev/null || true
+	[ -z "$reuse_iint" ] || echo "$reuse_iint" >"$REUSE_IINT"
+	rm -rf "$DIR"
+}
+
+fail() {
+	echo "overlay: FAIL: $*" >&2
+	exit 1
+}
+
+# Start a process in a new UTS namespace, print its pid once the
+# namespace is in place. It must not hold the caller's stdout.
+ns_holder() {
+	unshare -u sleep 600 >/dev/null 2>&1 &
+	while [ "$(readlink "/proc/$!/ns/uts")" = \
+		"$(readlink /proc/self/ns/uts)" ]; do
+		sleep 0.1
+	done
+	echo $!
+}
+
+trap cleanup EXIT
+
+[ -r "$DEBUGFS/hashes" ] || fail "container_ima is not loaded"
+
+rm -rf "$DIR"
+mkdir -p "$DIR/lower" "$DIR/merged1" "$DIR/merged2"
+for i in 1 2; do
+	mkdir -p "$DIR/upper$i" "$DIR/work$i"
+	mount -t overlay overlay -o "lowerdir=$DIR/lower,upperdir=$DIR/upper$i,workdir=$DIR/work$i" \
+		"$DIR/merged$i"
+done
+
+# New inode and contents, nothing can have hashed it yet
+printf '#!/bin/sh\n# %s %s\nexit 0\n' "$$" "$(date +%s%N)" >"$DIR/lower/prog"
+chmod 755 "$DIR/lower/prog"
+
+# Only the test file is measured, the interpreter is filtered out
+cat >"$DIR/filter" <<EOF
+path-default skip
+path $DIR/merged1/ measure
+path $DIR/merged2/ measure
+EOF
+
+# A digest host IMA collected would stand in for the hash
+if [ -w "$REUSE_IINT" ]; then
+	reuse_iint=$(cat "$REUSE_IINT")
+	echo N >"$REUSE_IINT"
+fi
+
+"$PROBE" -f "$DIR/filter" -o /dev/null &
+probe_pid=$!
+sleep 1
+kill -0 "$probe_pid" 2>/dev/null || fail "$PROBE exited"
+
+ns1=$(ns_holder)
+holders="$ns1"
+ns2=$(ns_holder)
+holders="$holders $ns2"
+
+# Measured whatever the host IMA policy says
+"$PROBE" policy set "pid:$ns1" measure >/dev/null
+"$PROBE" policy set "pid:$ns2" measure >/dev/null
+
+before=$(cat "$DEBUGFS/hashes")
+nsenter -u -t "$ns1" "$DIR/merged1/prog"
+nsenter -u -t "$ns2" "$DIR/merged2/prog"
+after=$(cat "$DEBUGFS/hashes")
+
+for i in 1 2; do
+	eval "pid=\$ns$i"
+	inum=$(readlink "/proc/$pid/ns/uts" | tr -dc 0-9)
+	grep -q " $inum:$DIR/merged$i/prog\$" "$SECURITYFS/ascii_measurements" ||
+		fail "namespace $inum did not log merged$i/prog"
+done
+
+[ $((after - before)) -eq 1 ] ||
+	fail "$((after - before)) hashes for one backing inode, expected 1"
+
+echo "overlay: ok"
@@ -3,47 +3,655 @@
 #include <bpf/bpf_core_read.h>
 #include <bpf/bpf_helpers.h>
 #include <string.h>
+#include "probe.h"
 
 #define bpf_target_x86
 #define bpf_target_defined
 #define PROT_EXEC 0x04
+#define SB_I_VERSION (1 << 23)
+#define I_VERSION_QUERIED_SHIFT 1
+
+/* bpf_process_measurement: file is measured for the namespace */
+#define IMA_NS_MEASURED 1
+/* ebpf_data policy, see container_ima.h */
+#define IMA_POLICY_HOST 0
+#define IMA_POLICY_MEASURE 1
+#define IMA_ALGO_DEFAULT 0xff
+/* ebpf_data hook */
+#define IMA_HOOK_MMAP 0
+#define IMA_HOOK_BPRM 1
+#define INODE_NS_SLOTS 8
 
 char _license[] SEC("license") = "GPL";
 
 struct ebpf_data {
         struct file *file;
         unsigned int ns;
+	u32 subject;		/* scan_target pid, 0: current */
+	u8 policy;
+	u8 hash_algo;
+	u8 hook;		/* IMA_HOOK_* */
+	/* set by bpf_process_measurement for a new measurement */
+	u8 algo;
+	u8 digest_len;
+	u8 flags;		/* IMA_EVENT_VERITY == MEASUREMENT_VERITY */
+	u8 digest[MEASUREMENT_DIGEST_MAX];
+};
+
+/*
+ * Argument block of bpf_process_measurement. Kept in task
+ * storage rather than on the stack: the kfunc sleeps and writes
+ * its result back, which the verifier cannot track on the stack.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct ebpf_data);
+} task_data_map SEC(".maps");
+
+/* Measurement events for probe.c */
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} events SEC(".maps");
+
+/* Latency histograms and counters, read by probe --stats */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HOOK_STAGE_MAX);
+	__type(key, u32);
+	__type(value, struct hist);
+} stage_hist SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, 4096);
+	__type(key, u32);
+	__type(value, struct hist);
+} ns_hist SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HOOK_COUNTER_MAX);
+	__type(key, u32);
+	__type(value, u64);
+} counters SEC(".maps");
+
+/*
+ * Pre-filter tables, maintained by probe.c. Mappings dropped
+ * here never reach the sleepable kfunc.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1024);
+	__type(key, u32);		/* uts namespace inum */
+	__type(value, u8);
+} filter_ns SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 64);
+	__type(key, u64);		/* superblock s_magic */
+	__type(value, u8);		/* enum filter_action */
+} filter_magic SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct filter_config);
+} filter_config SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 1024);
+	__type(key, struct filter_path_key);
+	__type(value, u8);		/* enum filter_action */
+} filter_path SEC(".maps");
+
+/*
+ * Per-container policy, pinned so the container runtime can
+ * update it through probe policy while the probe runs
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 4096);
+	__type(key, struct container_key);
+	__type(value, struct container_policy);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} container_policy SEC(".maps");
+
+/*
+ * Process a probe --scan thread maps files for, by thread id. The
+ * thread joins the container's uts namespace, but keeps the
+ * probe's cgroup and credentials.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, SCAN_THREADS_MAX);
+	__type(key, u32);
+	__type(value, struct scan_target);
+} scan_target SEC(".maps");
+
+/* bpf_d_path buffer, too large for the stack */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct filter_path_key);
+} path_scratch SEC(".maps");
+
+/* Inode holding the file contents, see bpf_file_version */
+struct file_version {
+	u64 version;
+	u64 ino;
+	u32 dev;
+	u32 pad;
+};
+
+/*
+ * Per-inode record of namespaces already measured at a version
+ * of the contents, each with the algorithm it requested (its
+ * policy's, or IMA_ALGO_DEFAULT), freed by the kernel together
+ * with the inode.
+ * Kept on the inode that was mapped: for overlay files that is
+ * the container's own overlay inode, and the recorded identity
+ * and version are those of the backing inode.
+ */
+struct inode_ns_state {
+	struct file_version ver;
+	u32 next;
+	u32 ns[INODE_NS_SLOTS];
+	u8 algo[INODE_NS_SLOTS];
 };
 
+struct {
+	__uint(type, BPF_MAP_TYPE_INODE_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct inode_ns_state);
+} inode_ns_map SEC(".maps");
+
+/*
+ * File bprm_hook measured for the exec in progress, and the mm
+ * it is being loaded into. The kernel maps the executable's
+ * segments right after bprm_check_security, with writes to it
+ * denied; those mappings are covered by the exec measurement.
+ */
+struct exec_state {
+	u64 inode;		/* struct inode *, 0: none */
+	u64 mm;			/* struct mm_struct * of the new image */
+	u64 i_version;
+	u32 ns;
+	u8 versioned;
+	u8 pad[3];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct exec_state);
+} exec_map SEC(".maps");
+
 extern int bpf_process_measurement(void *, int) __ksym;
+extern int bpf_file_version(struct file *, void *, int) __ksym;
 extern int measure_file(struct file *) __ksym;
 
+/*
+ * inode_version
+ * 	Read i_version the way inode_peek_iversion() does. Returns
+ * 	false when the counter cannot be trusted to track writes.
+ */
+static __always_inline bool inode_version(struct inode *inode, u64 *version)
+{
+	if (!(inode->i_sb->s_flags & SB_I_VERSION))
+		return false;
+	if (inode->i_writecount.counter > 0)
+		return false;
+
+	*version = inode->i_version.counter >> I_VERSION_QUERIED_SHIFT;
+	return true;
+}
+
+/*
+ * backing_version
+ * 	Version of the contents of file, read inline when its own
+ * 	inode tracks writes. Overlay inodes do not, the module then
+ * 	reports the backing inode. Returns false when the version
+ * 	cannot be trusted.
+ */
+static __always_inline bool backing_version(struct file *file,
+		struct file_version *ver)
+{
+	struct inode *inode = file->f_inode;
+
+	if (inode_version(inode, &ver->version)) {
+		ver->ino = inode->i_ino;
+		ver->dev = inode->i_sb->s_dev;
+		return true;
+	}
+	return !bpf_file_version(file, ver, sizeof(*ver));
+}
+
+static __always_inline u64 log2(u32 v)
+{
+	u32 shift, r;
+
+	r = (v > 0xFFFF) << 4; v >>= r;
+	shift = (v > 0xFF) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xF) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	r |= (v >> 1);
+
+	return r;
+}
+
+static __always_inline u64 log2l(u64 v)
+{
+	u32 hi = v >> 32;
+
+	return hi ? log2(hi) + 32 : log2(v);
+}
+
+/* Same buckets as the module: b counts [2^(b-1), 2^b) ns */
+static __always_inline void hist_add(struct hist *hist, u64 delta)
+{
+	u64 bucket = delta ? log2l(delta) + 1 : 0;
+
+	if (bucket >= HIST_BUCKETS)
+		bucket = HIST_BUCKETS - 1;
+	hist->slots[bucket]++;
+}
+
+static __always_inline void stage_record(u32 stage, u64 delta)
+{
+	struct hist *hist = bpf_map_lookup_elem(&stage_hist, &stage);
+
+	if (hist)
+		hist_add(hist, delta);
+}
+
+static __always_inline void ns_hist_record(u32 ns, u64 delta)
+{
+	static const struct hist zero;
+	struct hist *hist;
+
+	hist = bpf_map_lookup_elem(&ns_hist, &ns);
+	if (!hist) {
+		bpf_map_update_elem(&ns_hist, &ns, &zero, BPF_NOEXIST);
+		hist = bpf_map_lookup_elem(&ns_hist, &ns);
+		if (!hist)
+			return;
+	}
+	hist_add(hist, delta);
+}
+
+static __always_inline void count(u32 counter)
+{
+	u64 *value = bpf_map_lookup_elem(&counters, &counter);
+
+	if (value)
+		(*value)++;
+}
+
+/*
+ * filter_inode
+ * 	Cheap filters: namespace, filesystem and size. Returns
+ * 	the counter of the filter that dropped the mapping, or
+ * 	HOOK_COUNTER_MAX to measure it.
+ */
+static __always_inline u32 filter_inode(struct inode *inode, u32 ns,
+		struct filter_config *cfg)
+{
+	u64 magic = inode->i_sb->s_magic;
+	u64 size = inode->i_size;
+	u8 *action;
+
+	if (bpf_map_lookup_elem(&filter_ns, &ns))
+		return HOOK_FILTER_NS;
+
+	action = bpf_map_lookup_elem(&filter_magic, &magic);
+	if ((action ? *action : cfg->magic_default) == FILTER_SKIP)
+		return HOOK_FILTER_MAGIC;
+
+	if (size < cfg->min_size || (cfg->max_size && size > cfg->max_size))
+		return HOOK_FILTER_SIZE;
+
+	return HOOK_COUNTER_MAX;
+}
+
+/* Policy of the current container, namespace entry first */
+static __always_inline struct container_policy *container_lookup(u32 ns,
+		struct scan_target *scan)
+{
+	struct container_key key = { .type = CONTAINER_KEY_NS, .id = ns };
+	struct container_policy *policy;
+
+	policy = bpf_map_lookup_elem(&container_policy, &key);
+	if (policy)
+		return policy;
+
+	key.type = CONTAINER_KEY_CGROUP;
+	key.id = scan && scan->cgroup ? scan->cgroup : 
+		bpf_get_current_cgroup_id();
+	return bpf_map_lookup_elem(&container_policy, &key);
+}
+
+/*
+ * filter_file_path
+ * 	Longest prefix match of the file path in filter_path.
+ * 	Paths that do not resolve or fit get the default action.
+ */
+static __always_inline bool filter_file_path(struct file *file,
+		struct filter_config *cfg)
+{
+	struct filter_path_key *key;
+	u32 zero = 0;
+	u8 *action;
+	long len;
+
+	/* Skip bpf_d_path when there is nothing to match */
+	if (!cfg->path_rules)
+		return cfg->path_default == FILTER_SKIP;
+
+	key = bpf_map_lookup_elem(&path_scratch, &zero);
+	if (!key)
+		return cfg->path_default == FILTER_SKIP;
+
+	len = bpf_d_path(&file->f_path, key->path, sizeof(key->path));
+	if (len <= 0)
+		return cfg->path_default == FILTER_SKIP;
+
+	/* len counts the NUL */
+	key->prefixlen = (len - 1) * 8;
+	action = bpf_map_lookup_elem(&filter_path, key);
+
+	return (action ? *action : cfg->path_default) == FILTER_SKIP;
+}
+
+/* ver: the inode holding the contents, the same as the module's caches */
+static __always_inline void emit_event(struct ebpf_data *data,
+		struct file_version *ver, u64 start)
+{
+	struct measurement_event *e;
+
+	e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
+	if (!e) {
+		count(HOOK_EVENTS_DROPPED);
+		return;
+	}
+
+	e->timestamp_ns = start;
+	e->duration_ns = bpf_ktime_get_ns() - start;
+	e->ino = ver->ino;
+	e->dev = ver->dev;
+	e->ns = data->ns;
+	e->pid = bpf_get_current_pid_tgid() >> 32;
+	e->algo = data->algo;
+	e->digest_len = data->digest_len;
+	e->flags = data->flags;
+	e->pad = 0;
+	__builtin_memcpy(e->digest, data->digest, sizeof(e->digest));
+
+	bpf_ringbuf_submit(e, 0);
+}
+
+static __always_inline bool same_version(struct file_version *a,
+		struct file_version *b)
+{
+	return a->version == b->version && a->ino == b->ino &&
+		a->dev == b->dev;
+}
+
+static __always_inline bool ns_measured(struct inode_ns_state *state,
+		struct file_version *ver, u32 ns, u8 algo)
+{
+	int i;
+
+	if (!same_version(&state->ver, ver))
+		return false;
+
+	for (i = 0; i < INODE_NS_SLOTS; i++) {
+		if (state->ns[i] == ns && state->algo[i] == algo)
+			return true;
+	}
+	return false;
+}
+
+static __always_inline void ns_record(struct inode_ns_state *state,
+		struct file_version *ver, u32 ns, u8 algo)
+{
+	u32 slot;
+
+	if (!same_version(&state->ver, ver)) {
+		__builtin_memset(state->ns, 0, sizeof(state->ns));
+		state->next = 0;
+		state->ver = *ver;
+	}
+
+	slot = state->next++ % INODE_NS_SLOTS;
+	state->ns[slot] = ns;
+	state->algo[slot] = algo;
+}
+
+/* task_struct of kernels that have in_execve, see in_exec */
+struct task_struct___in_execve {
+	unsigned in_execve:1;
+} __attribute__((preserve_access_index));
+
+/*
+ * in_exec
+ * 	True while task is inside execve(): task->in_execve where the
+ * 	kernel has it, else fs->in_exec, which an exec only sets when
+ * 	it does not share its fs_struct. Both are cleared once the
+ * 	new image is loaded.
+ */
+static __always_inline bool in_exec(struct task_struct *task)
+{
+	struct task_struct___in_execve *t = (void *) task;
+	struct fs_struct *fs;
+
+	if (bpf_core_field_exists(t->in_execve))
+		return BPF_CORE_READ_BITFIELD_PROBED(t, in_execve);
+
+	fs = BPF_CORE_READ(task, fs);
+	return fs && BPF_CORE_READ_BITFIELD_PROBED(fs, in_exec);
+}
+
+/*
+ * exec_coalesced
+ * 	True if this PROT_EXEC mapping of inode is one of the exec's
+ * 	own, already measured by bprm_hook. The first mapping of
+ * 	another file (the interpreter) or the end of the execve()
+ * 	closes the exec's window, later mappings of the binary by
+ * 	the program itself are measured as usual.
+ */
+static __always_inline bool exec_coalesced(struct task_struct *task,
+		struct inode *inode, u32 ns)
+{
+	struct exec_state *exec;
+	u64 version;
+
+	exec = bpf_task_storage_get(&exec_map, task, 0, 0);
+	if (!exec || !exec->inode)
+		return false;
+
+	if (exec->inode != (u64) inode || exec->mm != (u64) task->mm ||
+			exec->ns != ns || !in_exec(task)) {
+		exec->inode = 0;
+		return false;
+	}
+
+	if (exec->versioned && (!inode_version(inode, &version) ||
+				version != exec->i_version))
+		return false;
+
+	count(HOOK_EXEC_COALESCED);
+	return true;
+}
+
+/*
+ * process_file
+ * 	Filters, container policy and the fast path, then the
+ * 	module. hook is the CONTAINER_HOOK_* of the caller.
+ * 	Returns IMA_NS_MEASURED if file is measured for ns.
+ */
+static __always_inline int process_file(struct file *file, u32 ns,
+		u16 hook)
+{
+    struct inode *inode;
+    struct inode_ns_state *state;
+    struct ebpf_data *data;
+    struct filter_config *cfg;
+    struct container_policy *policy;
+    struct scan_target *scan;
+    struct file_version ver = {};
+    u32 key, drop, tid;
+    u64 start;
+    u8 algo;
+    bool versioned;
+    int ret;
+
+	inode = file->f_inode;
+	key = 0;
+	cfg = bpf_map_lookup_elem(&filter_config, &key);
+	if (!cfg)
+		return 0;
+
+	drop = filter_inode(inode, ns, cfg);
+	if (drop != HOOK_COUNTER_MAX) {
+		count(drop);
+		return 0;
+	}
+
+	tid = (u32) bpf_get_current_pid_tgid();
+	scan = bpf_map_lookup_elem(&scan_target, &tid);
+	policy = container_lookup(ns, scan);
+	if (policy ? policy->mode == CONTAINER_OFF || 
+			!(policy->hooks & hook) : 
+			cfg->policy_required) {
+		count(HOOK_POLICY_OFF);
+		return 0;
+	}
+
+	algo = policy && policy->mode == CONTAINER_MEASURE_ALGO ? 
+		policy->algo : IMA_ALGO_DEFAULT;
+
+	/* Fast path, already measured for this namespace and algorithm */
+	versioned = backing_version(file, &ver);
+	state = bpf_inode_storage_get(&inode_ns_map, inode, 0,
+			BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (state && versioned && ns_measured(state, &ver, ns, algo)) {
+		count(HOOK_FAST_PATH);
+		return IMA_NS_MEASURED;
+	}
+
+	if (filter_file_path(file, cfg)) {
+		count(HOOK_FILTER_PATH);
+		return 0;
+	}
+	
+	data = bpf_task_storage_get(&task_data_map, 
+			bpf_get_current_task_btf(), 0, 
+			BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (!data)
+		return 0;
+	data->file = file;
+	data->ns = ns;
+	data->subject = scan ? scan->pid : 0;
+	data->policy = policy ? IMA_POLICY_MEASURE : IMA_POLICY_HOST;
+	data->hash_algo = algo;
+	data->hook = hook == CONTAINER_HOOK_BPRM ? IMA_HOOK_BPRM : 
+		IMA_HOOK_MMAP;
+	
+	count(HOOK_KFUNC_CALLS);
+	start = bpf_ktime_get_ns();
+	ret = bpf_process_measurement((void *) data, 
+			sizeof(*data));
+	stage_record(HOOK_STAGE_KFUNC, bpf_ktime_get_ns() - start);
+
+	if (ret == IMA_NS_MEASURED && state && versioned)
+		ns_record(state, &ver, ns, algo);
+
+	if (data->digest_len)
+		emit_event(data, &ver, start);
+
+	return ret;
+}
+
 SEC("lsm.s/mmap_file")
 int BPF_PROG(mmap_hook, struct file *file, unsigned int reqprot, 
 		unsigned int prot, int flags) 
 {
     struct task_struct *task;
-    u32 key;
+    u64 entry;
     unsigned int ns;
-    int ret;
 
     if (!file) 
 	return 0;
     
     if (prot & PROT_EXEC || reqprot & PROT_EXEC) {
 	
-	task = (void *) bpf_get_current_task();
+	entry = bpf_ktime_get_ns();
+	task = bpf_get_current_task_btf();
         ns = BPF_CORE_READ(task, nsproxy, uts_ns, ns.inum);
-	
-	struct ebpf_data data = { .file = file, .ns = ns };
-	
-	ret = bpf_process_measurement((void *) &data, 
-			sizeof(&data));
 
+	if (!exec_coalesced(task, file->f_inode, ns))
+		process_file(file, ns, CONTAINER_HOOK_MMAP);
 
+	entry = bpf_ktime_get_ns() - entry;
+	stage_record(HOOK_STAGE_MMAP, entry);
+	ns_hist_record(ns, entry);
     }
 
     
     return 0;
 
 }
+
+/*
+ * bprm_hook
+ * 	Measure the file being executed once, and let the kernel's
+ * 	mappings of its segments through exec_coalesced
+ */
+SEC("lsm.s/bprm_check_security")
+int BPF_PROG(bprm_hook, struct linux_binprm *bprm)
+{
+    struct task_struct *task;
+    struct exec_state *exec;
+    struct file *file;
+    u64 entry;
+    unsigned int ns;
+    int ret;
+
+    file = bprm->file;
+    if (!file)
+	return 0;
+
+    entry = bpf_ktime_get_ns();
+    task = bpf_get_current_task_btf();
+    ns = BPF_CORE_READ(task, nsproxy, uts_ns, ns.inum);
+
+    /* A new exec, or the interpreter of a script, starts over */
+    exec = bpf_task_storage_get(&exec_map, task, 0,
+		    BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (exec)
+	exec->inode = 0;
+
+    ret = process_file(file, ns, CONTAINER_HOOK_BPRM);
+    if (exec && ret == IMA_NS_MEASURED) {
+	exec->inode = (u64) file->f_inode;
+	exec->mm = (u64) bprm->mm;
+	exec->ns = ns;
+	exec->versioned = inode_version(file->f_inode, &exec->i_version);
+    }
+
+    entry = bpf_ktime_get_ns() - entry;
+    stage_record(HOOK_STAGE_BPRM, entry);
+    ns_hist_record(ns, entry);
+
+    return 0;
+}
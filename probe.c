@@ -2,16 +2,1728 @@
  * File: probe.c
  * 	Program to load, attach and 
  * 	destroy eBPF probe
+ * 	Streams measurement events from the probe's
+ * 	ring buffer as fixed size binary records
+ * 	Prints per-stage and per-namespace latency
+ * 	percentiles with --stats
+ * 	Maintains the probe's pre-filter tables from
+ * 	--filter, reloaded on SIGHUP
+ * 	probe policy edits the pinned per-container
+ * 	policy map of a running probe
+ * 	probe export moves finalized namespace records
+ * 	from the module to a hash-chained file
+ * 	probe log reads one namespace's records from a
+ * 	sequence number
+ * 	--scan measures the executable mappings of
+ * 	processes that were running before the attach
+ * 	--pin keeps the hooks and maps in bpffs, so a
+ * 	restarted or upgraded probe takes over without
+ * 	a gap; probe detach removes them
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#include <linux/magic.h>
+#include <linux/if_alg.h>
 #include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "probe.h"
 #include "probe.skel.h"
 
+#define POLL_TIMEOUT_MS 100
+#define MODULE_STATS "/sys/kernel/debug/container_ima/stats"
+#define MODULE_HOST_NS "/sys/kernel/debug/container_ima/host_ns"
+#define MODULE_EXPORT "/sys/kernel/security/container_ima/export"
+/* IMA_EXPORT_BUF in container_ima.h */
+#define EXPORT_BUF (64 * 1024)
+#define EXPORT_INTERVAL_SEC 10
+/* --pin: maps by name, links as link_<program> */
+#define PIN_DIR "/sys/fs/bpf/container_ima"
+/* LIBBPF_PIN_BY_NAME location of container_policy */
+#define POLICY_PIN "/sys/fs/bpf/container_policy"
+
+/* Sizes of the filter maps in probe.bpf.c */
+#define FILTER_NS_MAX 1024
+#define FILTER_MAGIC_MAX 64
+#define FILTER_PATHS_MAX 1024
+
+static volatile sig_atomic_t exiting;
+static volatile sig_atomic_t reload;
+
+static void sig_handler(int sig)
+{
+	if (sig == SIGHUP)
+		reload = 1;
+	else
+		exiting = 1;
+}
+
+/* Pseudo filesystems skipped unless the filter file says otherwise */
+static const __u64 default_skip_magic[] = {
+	PROC_SUPER_MAGIC, SYSFS_MAGIC, DEBUGFS_MAGIC, SECURITYFS_MAGIC, 
+	TRACEFS_MAGIC, SELINUX_MAGIC, CGROUP_SUPER_MAGIC, 
+	CGROUP2_SUPER_MAGIC, BPF_FS_MAGIC, DEVPTS_SUPER_MAGIC, NSFS_MAGIC, 
+	EFIVARFS_MAGIC, PIPEFS_MAGIC, SOCKFS_MAGIC, ANON_INODE_FS_MAGIC, 
+};
+
+/* Desired contents of the filter maps */
+struct filter {
+	struct filter_config config;
+	__u32 ns[FILTER_NS_MAX];
+	__u8 ns_action[FILTER_NS_MAX];
+	size_t nr_ns;
+	__u64 magic[FILTER_MAGIC_MAX];
+	__u8 magic_action[FILTER_MAGIC_MAX];
+	size_t nr_magic;
+	struct filter_path_key path[FILTER_PATHS_MAX];
+	__u8 path_action[FILTER_PATHS_MAX];
+	size_t nr_path;
+};
+
+/*
+ * handle_event
+ * 	Ring buffer callback, appends one struct measurement_event
+ * 	to the output stream. Writes are buffered and flushed once
+ * 	per poll batch.
+ */
+static int handle_event(void *ctx, void *data, size_t size)
+{
+	FILE *out = ctx;
+
+	if (!out || size < sizeof(struct measurement_event))
+		return 0;
+
+	if (fwrite(data, sizeof(struct measurement_event), 1, out) != 1)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * hist_percentile
+ * 	Upper bound in ns of the bucket holding percentile p
+ */
+static __u64 hist_percentile(const __u64 *slots, __u64 total, double p)
+{
+	__u64 cumulative = 0, target;
+	int i;
+
+	target = (__u64) (p * total + 0.5);
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		cumulative += slots[i];
+		if (cumulative >= target)
+			return i ? 1ULL << i : 0;
+	}
+	return 1ULL << (HIST_BUCKETS - 1);
+}
+
+static const char *format_ns(__u64 ns, char *buf, size_t len)
+{
+	if (ns >= 1000000)
+		snprintf(buf, len, "%.1fms", ns / 1e6);
+	else if (ns >= 1000)
+		snprintf(buf, len, "%.1fus", ns / 1e3);
+	else
+		snprintf(buf, len, "%lluns", (unsigned long long) ns);
+	return buf;
+}
+
+static void print_hist(const char *name, const __u64 *slots)
+{
+	char p50[16], p99[16];
+	__u64 total = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += slots[i];
+	if (!total)
+		return;
+
+	printf("  %-20s %12llu %10s %10s\n", name, 
+	       (unsigned long long) total, 
+	       format_ns(hist_percentile(slots, total, 0.50), p50, sizeof(p50)), 
+	       format_ns(hist_percentile(slots, total, 0.99), p99, sizeof(p99)));
+}
+
+/* Sum one per-CPU struct hist value */
+static int read_percpu_hist(int fd, const void *key, struct hist *sum)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	struct hist *values;
+	int cpu, i;
+
+	values = calloc(ncpus, sizeof(*values));
+	if (!values)
+		return -ENOMEM;
+
+	if (bpf_map_lookup_elem(fd, key, values)) {
+		free(values);
+		return -errno;
+	}
+
+	memset(sum, 0, sizeof(*sum));
+	for (cpu = 0; cpu < ncpus; cpu++)
+		for (i = 0; i < HIST_BUCKETS; i++)
+			sum->slots[i] += values[cpu].slots[i];
+
+	free(values);
+	return 0;
+}
+
+static __u64 read_percpu_counter(int fd, __u32 key)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	__u64 *values, sum = 0;
+	int cpu;
+
+	values = calloc(ncpus, sizeof(*values));
+	if (!values)
+		return 0;
+
+	if (!bpf_map_lookup_elem(fd, &key, values))
+		for (cpu = 0; cpu < ncpus; cpu++)
+			sum += values[cpu];
+
+	free(values);
+	return sum;
+}
+
+/*
+ * print_module_stats
+ * 	Parse debugfs container_ima/stats, one line per stage:
+ * 	stage hits misses errors bucket0 ... bucket31
+ */
+static void print_module_stats(void)
+{
+	char line[1024], name[64];
+	unsigned long long hits, misses, errors;
+	__u64 slots[HIST_BUCKETS];
+	char *pos, *end;
+	FILE *f;
+	int i, n;
+
+	f = fopen(MODULE_STATS, "r");
+	if (!f) {
+		printf("module: %s: %s\n", MODULE_STATS, strerror(errno));
+		return;
+	}
+
+	printf("module %-13s %12s %10s %10s %10s %10s %8s\n", "stage", 
+	       "count", "p50", "p99", "hits", "misses", "errors");
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %llu %llu %llu%n", name, &hits, &misses, 
+			   &errors, &n) != 4)
+			continue;
+
+		pos = line + n;
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			slots[i] = strtoull(pos, &end, 10);
+			pos = end;
+		}
+
+		print_hist(name, slots);
+		if (hits || misses || errors)
+			printf("  %-20s %35s %10llu %10llu %8llu\n", "", "", 
+			       hits, misses, errors);
+	}
+	fclose(f);
+}
+
+static void print_stats(struct probe_bpf *skel)
+{
+	static const char * const stage_names[HOOK_STAGE_MAX] = {
+		[HOOK_STAGE_MMAP] = "mmap_hook", 
+		[HOOK_STAGE_KFUNC] = "kfunc", 
+		[HOOK_STAGE_BPRM] = "bprm_hook", 
+	};
+	int counters_fd = bpf_map__fd(skel->maps.counters);
+	int ns_fd = bpf_map__fd(skel->maps.ns_hist);
+	struct hist hist;
+	__u32 key, next, *prev = NULL;
+	char name[32];
+
+	print_module_stats();
+
+	printf("probe  %-13s %12s %10s %10s\n", "stage", "count", "p50", 
+	       "p99");
+	for (key = 0; key < HOOK_STAGE_MAX; key++)
+		if (!read_percpu_hist(bpf_map__fd(skel->maps.stage_hist), 
+				      &key, &hist))
+			print_hist(stage_names[key], hist.slots);
+
+	printf("  fast path %llu, exec coalesced %llu, kfunc calls %llu, "
+	       "events dropped %llu\n", 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_FAST_PATH), 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_EXEC_COALESCED), 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_KFUNC_CALLS), 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_EVENTS_DROPPED));
+	printf("  filtered: ns %llu, magic %llu, size %llu, path %llu, "
+	       "policy %llu\n", 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_FILTER_NS), 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_FILTER_MAGIC), 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_FILTER_SIZE), 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_FILTER_PATH), 
+	       (unsigned long long) read_percpu_counter(counters_fd, 
+							HOOK_POLICY_OFF));
+
+	printf("probe  %-13s %12s %10s %10s\n", "namespace", "count", "p50", 
+	       "p99");
+	while (!bpf_map_get_next_key(ns_fd, prev, &next)) {
+		if (!read_percpu_hist(ns_fd, &next, &hist)) {
+			snprintf(name, sizeof(name), "%u", next);
+			print_hist(name, hist.slots);
+		}
+		key = next;
+		prev = &key;
+	}
+	fflush(stdout);
+}
+
+/* uts namespace of the host: the module's host_ns, else init's */
+static __u32 host_ns(void)
+{
+	unsigned int inum = 0;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(MODULE_HOST_NS, "r");
+	if (f) {
+		if (fscanf(f, "%u", &inum) != 1)
+			inum = 0;
+		fclose(f);
+	}
+	if (!inum && !stat("/proc/1/ns/uts", &st))
+		inum = st.st_ino;
+	return inum;
+}
+
+static int parse_action(const char *str, __u8 *action)
+{
+	if (!strcmp(str, "measure"))
+		*action = FILTER_MEASURE;
+	else if (!strcmp(str, "skip"))
+		*action = FILTER_SKIP;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+static int parse_size(const char *str, __u64 *size)
+{
+	char *end;
+
+	errno = 0;
+	*size = strtoull(str, &end, 0);
+	switch (tolower(*end)) {
+	case 'g':
+		*size <<= 10;
+		/* fallthrough */
+	case 'm':
+		*size <<= 10;
+		/* fallthrough */
+	case 'k':
+		*size <<= 10;
+		end++;
+	}
+	return errno || *end ? -EINVAL : 0;
+}
+
+/*
+ * filter_load
+ * 	Parse a filter file, one rule per line, # comments:
+ * 	  ns INUM                 skip the uts namespace
+ * 	  magic HEX measure|skip  action for a filesystem magic
+ * 	  magic-default measure|skip
+ * 	  path PREFIX measure|skip  longest matching prefix wins
+ * 	  path-default measure|skip
+ * 	  min-size SIZE           skip smaller files
+ * 	  max-size SIZE           skip larger files
+ */
+static int filter_load(struct filter *f, const char *path)
+{
+	char line[FILTER_PATH_MAX + 64], *argv[3], *save, *p;
+	unsigned long long value;
+	int lineno = 0, argc, ret = 0;
+	struct filter_path_key *key;
+	size_t i;
+	FILE *file;
+	__u8 action;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -errno;
+
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		argc = 0;
+		for (p = strtok_r(line, " \t\n", &save); p && argc < 3; 
+		     p = strtok_r(NULL, " \t\n", &save))
+			argv[argc++] = p;
+		if (!argc)
+			continue;
+
+		ret = -EINVAL;
+		if (!strcmp(argv[0], "ns") && argc == 2) {
+			if (f->nr_ns == FILTER_NS_MAX)
+				break;
+			value = strtoull(argv[1], &p, 0);
+			if (*p)
+				break;
+			f->ns[f->nr_ns] = value;
+			f->ns_action[f->nr_ns++] = FILTER_SKIP;
+		} else if (!strcmp(argv[0], "magic") && argc == 3) {
+			value = strtoull(argv[1], &p, 16);
+			if (*p || parse_action(argv[2], &action))
+				break;
+			/* A rule replaces the default for the same magic */
+			for (i = 0; i < f->nr_magic; i++)
+				if (f->magic[i] == value)
+					break;
+			if (i == FILTER_MAGIC_MAX)
+				break;
+			f->magic[i] = value;
+			f->magic_action[i] = action;
+			if (i == f->nr_magic)
+				f->nr_magic++;
+		} else if (!strcmp(argv[0], "magic-default") && argc == 2) {
+			if (parse_action(argv[1], &f->config.magic_default))
+				break;
+		} else if (!strcmp(argv[0], "path") && argc == 3) {
+			if (f->nr_path == FILTER_PATHS_MAX || 
+			    strlen(argv[1]) > FILTER_PATH_MAX || 
+			    parse_action(argv[2], &action))
+				break;
+			key = &f->path[f->nr_path];
+			memset(key, 0, sizeof(*key));
+			memcpy(key->path, argv[1], strlen(argv[1]));
+			key->prefixlen = strlen(argv[1]) * 8;
+			f->path_action[f->nr_path++] = action;
+		} else if (!strcmp(argv[0], "path-default") && argc == 2) {
+			if (parse_action(argv[1], &f->config.path_default))
+				break;
+		} else if (!strcmp(argv[0], "min-size") && argc == 2) {
+			if (parse_size(argv[1], &f->config.min_size))
+				break;
+		} else if (!strcmp(argv[0], "max-size") && argc == 2) {
+			if (parse_size(argv[1], &f->config.max_size))
+				break;
+		} else {
+			break;
+		}
+		ret = 0;
+	}
+
+	if (ret)
+		fprintf(stderr, "%s:%d: invalid filter rule\n", path, lineno);
+	fclose(file);
+	return ret;
+}
+
+/*
+ * filter_build
+ * 	Defaults (host namespace unless measure_host, pseudo
+ * 	filesystems) followed by the rules of path, if any.
+ * 	With opt_in only containers in container_policy are measured.
+ */
+static int filter_build(struct filter *f, const char *path, 
+		bool measure_host, bool opt_in)
+{
+	size_t i;
+
+	memset(f, 0, sizeof(*f));
+	f->config.magic_default = FILTER_MEASURE;
+	f->config.path_default = FILTER_MEASURE;
+	f->config.policy_required = opt_in;
+
+	if (!measure_host) {
+		f->ns[0] = host_ns();
+		f->ns_action[0] = FILTER_SKIP;
+		f->nr_ns = f->ns[0] ? 1 : 0;
+	}
+
+	for (i = 0; i < sizeof(default_skip_magic) / sizeof(__u64); i++) {
+		f->magic[i] = default_skip_magic[i];
+		f->magic_action[i] = FILTER_SKIP;
+	}
+	f->nr_magic = i;
+
+	return path ? filter_load(f, path) : 0;
+}
+
+/*
+ * sync_map
+ * 	Make a hash or LPM map hold exactly keys/values: update
+ * 	every entry first, then delete the stale ones, so rules
+ * 	present before and after a reload never lapse
+ */
+static int sync_map(int fd, const void *keys, size_t key_size, 
+		const void *values, size_t value_size, size_t n)
+{
+	size_t i, j, nr_old = 0, max_old = 64;
+	char *old, *grown;
+	int ret = 0;
+
+	/* Collect the current keys before touching the map */
+	old = malloc(max_old * key_size);
+	if (!old)
+		return -ENOMEM;
+	while (!bpf_map_get_next_key(fd, nr_old ? 
+				     old + (nr_old - 1) * key_size : NULL, 
+				     old + nr_old * key_size)) {
+		if (++nr_old == max_old) {
+			grown = realloc(old, 2 * max_old * key_size);
+			if (!grown) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			old = grown;
+			max_old *= 2;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (bpf_map_update_elem(fd, (const char *) keys + i * key_size, 
+					(const char *) values + i * value_size, 
+					BPF_ANY)) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_old; i++) {
+		for (j = 0; j < n; j++)
+			if (!memcmp(old + i * key_size, 
+				    (const char *) keys + j * key_size, 
+				    key_size))
+				break;
+		if (j == n)
+			bpf_map_delete_elem(fd, old + i * key_size);
+	}
+out:
+	free(old);
+	return ret;
+}
+
+static int filter_apply(struct probe_bpf *skel, struct filter *f)
+{
+	__u32 zero = 0;
+	int ret;
+
+	f->config.path_rules = f->nr_path > 0;
+
+	ret = sync_map(bpf_map__fd(skel->maps.filter_ns), f->ns, 
+		       sizeof(f->ns[0]), f->ns_action, 1, f->nr_ns);
+	if (!ret)
+		ret = sync_map(bpf_map__fd(skel->maps.filter_magic), f->magic, 
+			       sizeof(f->magic[0]), f->magic_action, 1, 
+			       f->nr_magic);
+	if (!ret)
+		ret = sync_map(bpf_map__fd(skel->maps.filter_path), f->path, 
+			       sizeof(f->path[0]), f->path_action, 1, 
+			       f->nr_path);
+	if (!ret && bpf_map_update_elem(bpf_map__fd(skel->maps.filter_config), 
+					&zero, &f->config, BPF_ANY))
+		ret = -errno;
+	return ret;
+}
+
+/* Hash algorithm names, values of the kernel's enum hash_algo */
+static const struct {
+	const char *name;
+	__u8 algo;
+} policy_algos[] = {
+	{ "md5", 1 }, { "sha1", 2 }, { "rmd160", 3 }, { "sha256", 4 }, 
+	{ "sha384", 5 }, { "sha512", 6 }, { "sha224", 7 }, 
+	{ "sm3-256", 17 }, { "streebog256", 18 }, { "streebog512", 19 }, 
+};
+
+static const char * const policy_modes[] = {
+	[CONTAINER_OFF] = "off", 
+	[CONTAINER_MEASURE] = "measure", 
+	[CONTAINER_MEASURE_ALGO] = "measure", 
+};
+
+/* Number or inode number of a namespace or cgroup path */
+static int parse_id(const char *str, __u64 *id)
+{
+	struct stat st;
+	char *end;
+
+	if (str[0] == '/') {
+		if (stat(str, &st))
+			return -errno;
+		*id = st.st_ino;
+		return 0;
+	}
+
+	errno = 0;
+	*id = strtoull(str, &end, 0);
+	return errno || !*str || *end ? -EINVAL : 0;
+}
+
+/*
+ * parse_container_key
+ * 	ns:INUM, ns:/proc/PID/ns/uts, pid:PID (its uts namespace),
+ * 	cgroup:ID or cgroup:/sys/fs/cgroup/PATH
+ */
+static int parse_container_key(const char *str, struct container_key *key)
+{
+	char path[64];
+	__u64 pid;
+
+	memset(key, 0, sizeof(*key));
+	if (!strncmp(str, "ns:", 3)) {
+		key->type = CONTAINER_KEY_NS;
+		return parse_id(str + 3, &key->id);
+	}
+	if (!strncmp(str, "cgroup:", 7)) {
+		key->type = CONTAINER_KEY_CGROUP;
+		return parse_id(str + 7, &key->id);
+	}
+	if (!strncmp(str, "pid:", 4) && !parse_id(str + 4, &pid)) {
+		snprintf(path, sizeof(path), "/proc/%llu/ns/uts", 
+			 (unsigned long long) pid);
+		key->type = CONTAINER_KEY_NS;
+		return parse_id(path, &key->id);
+	}
+	return -EINVAL;
+}
+
+/* off, measure or measure:ALGO */
+static int parse_container_mode(const char *str, 
+		struct container_policy *policy)
+{
+	size_t i;
+
+	if (!strcmp(str, "off")) {
+		policy->mode = CONTAINER_OFF;
+		return 0;
+	}
+	if (!strcmp(str, "measure")) {
+		policy->mode = CONTAINER_MEASURE;
+		return 0;
+	}
+	if (strncmp(str, "measure:", 8))
+		return -EINVAL;
+
+	for (i = 0; i < sizeof(policy_algos) / sizeof(policy_algos[0]); i++) {
+		if (!strcmp(str + 8, policy_algos[i].name)) {
+			policy->mode = CONTAINER_MEASURE_ALGO;
+			policy->algo = policy_algos[i].algo;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static int parse_container_hooks(char *str, __u16 *hooks)
+{
+	char *tok, *save;
+
+	*hooks = 0;
+	for (tok = strtok_r(str, ",", &save); tok; 
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "mmap"))
+			*hooks |= CONTAINER_HOOK_MMAP;
+		else if (!strcmp(tok, "exec"))
+			*hooks |= CONTAINER_HOOK_BPRM;
+		else if (!strcmp(tok, "all"))
+			*hooks |= CONTAINER_HOOKS_ALL;
+		else
+			return -EINVAL;
+	}
+	return *hooks ? 0 : -EINVAL;
+}
+
+static void print_container_policy(const struct container_key *key, 
+		const struct container_policy *policy)
+{
+	static const char * const hook_names[CONTAINER_HOOKS_ALL + 1] = {
+		[0] = "none", 
+		[CONTAINER_HOOK_MMAP] = "mmap", 
+		[CONTAINER_HOOK_BPRM] = "exec", 
+		[CONTAINER_HOOKS_ALL] = "mmap,exec", 
+	};
+	const char *algo = NULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(policy_algos) / sizeof(policy_algos[0]); i++)
+		if (policy_algos[i].algo == policy->algo)
+			algo = policy_algos[i].name;
+
+	printf("%s:%llu %s", key->type == CONTAINER_KEY_CGROUP ? 
+	       "cgroup" : "ns", (unsigned long long) key->id, 
+	       policy->mode <= CONTAINER_MEASURE_ALGO ? 
+	       policy_modes[policy->mode] : "?");
+	if (policy->mode == CONTAINER_MEASURE_ALGO)
+		printf(":%s", algo ? algo : "?");
+	printf(" hooks=%s\n", hook_names[policy->hooks & CONTAINER_HOOKS_ALL]);
+}
+
+static void usage(const char *prog);
+
+/*
+ * policy_command
+ * 	probe policy set KEY MODE [HOOKS]
+ * 	probe policy del KEY
+ * 	probe policy list
+ * 	Edits the container_policy map pinned by a running probe,
+ * 	changes apply to the next mapping without reloading anything
+ */
+static int policy_command(const char *prog, int argc, char **argv)
+{
+	struct container_policy policy = { .hooks = CONTAINER_HOOKS_ALL };
+	struct container_key key, next, *prev = NULL;
+	int fd, ret = 0;
+
+	fd = bpf_obj_get(POLICY_PIN);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s, is the probe running? "
+			"%s\n", POLICY_PIN, strerror(errno));
+		return -1;
+	}
+
+	if (argc == 1 && !strcmp(argv[0], "list")) {
+		while (!bpf_map_get_next_key(fd, prev, &next)) {
+			if (!bpf_map_lookup_elem(fd, &next, &policy))
+				print_container_policy(&next, &policy);
+			key = next;
+			prev = &key;
+		}
+	} else if ((argc == 3 || argc == 4) && !strcmp(argv[0], "set")) {
+		if (parse_container_key(argv[1], &key) || 
+		    parse_container_mode(argv[2], &policy) || 
+		    (argc == 4 && parse_container_hooks(argv[3], 
+							&policy.hooks))) {
+			fprintf(stderr, "Invalid policy\n");
+			ret = -1;
+		} else if (bpf_map_update_elem(fd, &key, &policy, BPF_ANY)) {
+			fprintf(stderr, "Failed to set policy: %s\n", 
+				strerror(errno));
+			ret = -1;
+		}
+	} else if (argc == 2 && !strcmp(argv[0], "del")) {
+		if (parse_container_key(argv[1], &key)) {
+			fprintf(stderr, "Invalid container %s\n", argv[1]);
+			ret = -1;
+		} else if (bpf_map_delete_elem(fd, &key)) {
+			fprintf(stderr, "Failed to delete policy: %s\n", 
+				strerror(errno));
+			ret = -1;
+		}
+	} else {
+		usage(prog);
+		ret = -1;
+	}
+
+	close(fd);
+	return ret;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Scan
+ * 	The probe only sees mappings made after it attaches. --scan
+ * 	catches up with running containers: worker threads take the
+ * 	processes of /proc in turn, join each one's uts namespace
+ * 	(setns only moves the calling thread) and map every
+ * 	executable file of /proc/PID/map_files PROT_EXEC once. That
+ * 	goes through mmap_hook and the module like the container's
+ * 	own mappings, with its namespace, filters and policy;
+ * 	scan_target stands in for the process's cgroup and, in the
+ * 	module's IMA policy lookup, its credentials. Files are
+ * 	mapped once per namespace, deduplicated by dev and inode.
+ */
+struct scan_key {
+	__u64 dev;
+	__u64 ino;
+	__u32 ns;
+	__u32 used;
+};
+
+struct scan {
+	pthread_t thread;
+	int threads;
+	int target_fd;		/* scan_target */
+	__u32 host_ns;
+	bool measure_host;
+	pid_t *pids;
+	size_t nr_pids;
+	size_t next;		/* next pid, taken atomically */
+	pthread_mutex_t lock;	/* protects seen */
+	struct scan_key *seen;	/* open addressing, half full at most */
+	size_t seen_size, nr_seen;
+	unsigned long mapped;	/* atomic */
+};
+
+static __u64 scan_hash(__u64 dev, __u64 ino, __u32 ns)
+{
+	__u64 h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino ^ ((__u64) ns << 32);
+
+	return h ^ (h >> 29);
+}
+
+static void scan_add(struct scan_key *table, size_t size, 
+		     const struct scan_key *key)
+{
+	size_t i = scan_hash(key->dev, key->ino, key->ns) & (size - 1);
+
+	while (table[i].used)
+		i = (i + 1) & (size - 1);
+	table[i] = *key;
+}
+
+/* True the first time dev:ino is seen for ns */
+static bool scan_first(struct scan *scan, __u64 dev, __u64 ino, __u32 ns)
+{
+	struct scan_key key = { dev, ino, ns, 1 }, *table;
+	bool first = false;
+	size_t i, size;
+
+	pthread_mutex_lock(&scan->lock);
+	if (2 * (scan->nr_seen + 1) > scan->seen_size) {
+		size = scan->seen_size ? scan->seen_size * 2 : 4096;
+		table = calloc(size, sizeof(*table));
+		if (!table)
+			goto out;
+		for (i = 0; i < scan->seen_size; i++) {
+			if (scan->seen[i].used)
+				scan_add(table, size, &scan->seen[i]);
+		}
+		free(scan->seen);
+		scan->seen = table;
+		scan->seen_size = size;
+	}
+
+	i = scan_hash(dev, ino, ns) & (scan->seen_size - 1);
+	for (; scan->seen[i].used; i = (i + 1) & (scan->seen_size - 1)) {
+		if (scan->seen[i].dev == dev && scan->seen[i].ino == ino && 
+		    scan->seen[i].ns == ns)
+			goto out;
+	}
+	scan->seen[i] = key;
+	scan->nr_seen++;
+	first = true;
+out:
+	pthread_mutex_unlock(&scan->lock);
+	return first;
+}
+
+/* cgroup v2 id of pid, the inode number of its directory */
+static __u64 pid_cgroup(pid_t pid)
+{
+	char path[PATH_MAX], line[PATH_MAX];
+	struct stat st;
+	__u64 id = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s", line + 3);
+		if (!stat(path, &st))
+			id = st.st_ino;
+		break;
+	}
+	fclose(f);
+	return id;
+}
+
+/* Map the executable files of pid, from its uts namespace */
+static void scan_pid(struct scan *scan, pid_t pid, int self_ns)
+{
+	char path[64], line[PATH_MAX + 128], perms[5];
+	unsigned long start, end, inode;
+	struct scan_target target = { .pid = pid };
+	__u32 tid = gettid();
+	struct stat st;
+	FILE *maps;
+	void *addr;
+	int ns_fd, fd;
+	__u32 ns;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/uts", pid);
+	if (stat(path, &st))
+		return;
+	ns = st.st_ino;
+	if (ns == scan->host_ns && !scan->measure_host)
+		return;
+
+	ns_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (ns_fd < 0)
+		return;
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	maps = fopen(path, "r");
+	if (!maps || setns(ns_fd, CLONE_NEWUTS)) {
+		if (maps)
+			fclose(maps);
+		close(ns_fd);
+		return;
+	}
+
+	target.cgroup = pid_cgroup(pid);
+	if (bpf_map_update_elem(scan->target_fd, &tid, &target, BPF_ANY)) {
+		/* The probe's own credentials would be matched instead */
+		setns(self_ns, CLONE_NEWUTS);
+		fclose(maps);
+		close(ns_fd);
+		return;
+	}
+
+	while (!exiting && fgets(line, sizeof(line), maps)) {
+		if (sscanf(line, "%lx-%lx %4s %*s %*s %lu", &start, &end, 
+			   perms, &inode) != 4 || perms[2] != 'x' || !inode)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/map_files/%lx-%lx", 
+			 pid, start, end);
+		if (stat(path, &st) || !scan_first(scan, st.st_dev, 
+						   st.st_ino, ns))
+			continue;
+
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		addr = mmap(NULL, 1, PROT_READ | PROT_EXEC, MAP_PRIVATE, 
+			    fd, 0);
+		if (addr != MAP_FAILED) {
+			munmap(addr, 1);
+			__atomic_add_fetch(&scan->mapped, 1, __ATOMIC_RELAXED);
+		}
+		close(fd);
+	}
+
+	bpf_map_delete_elem(scan->target_fd, &tid);
+	setns(self_ns, CLONE_NEWUTS);
+	fclose(maps);
+	close(ns_fd);
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan *scan = arg;
+	size_t i;
+	int self_ns;
+
+	self_ns = open("/proc/thread-self/ns/uts", O_RDONLY | O_CLOEXEC);
+	if (self_ns < 0)
+		return NULL;
+
+	while (!exiting) {
+		i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+		if (i >= scan->nr_pids)
+			break;
+		scan_pid(scan, scan->pids[i], self_ns);
+	}
+
+	close(self_ns);
+	return NULL;
+}
+
+static int scan_pids(struct scan *scan)
+{
+	struct dirent *de;
+	size_t max = 0;
+	pid_t pid, *pids;
+	char *end;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return -1;
+	while ((de = readdir(dir))) {
+		pid = strtol(de->d_name, &end, 10);
+		if (*end || pid <= 0 || pid == getpid())
+			continue;
+		if (scan->nr_pids == max) {
+			max = max ? max * 2 : 1024;
+			pids = realloc(scan->pids, max * sizeof(*pids));
+			if (!pids) {
+				closedir(dir);
+				return -1;
+			}
+			scan->pids = pids;
+		}
+		scan->pids[scan->nr_pids++] = pid;
+	}
+	closedir(dir);
+	return 0;
+}
+
+static void *scan_main(void *arg)
+{
+	struct scan *scan = arg;
+	pthread_t workers[SCAN_THREADS_MAX];
+	double start = now_sec();
+	int i, started = 0;
+
+	if (scan_pids(scan)) {
+		fprintf(stderr, "Failed to list processes\n");
+		return NULL;
+	}
+
+	for (i = 0; i < scan->threads; i++) {
+		if (pthread_create(&workers[i], NULL, scan_worker, scan))
+			break;
+		started++;
+	}
+	if (!started)
+		scan_worker(scan);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	fprintf(stderr, "scan: %zu processes, %lu executable files "
+		"mapped in %.2fs\n", scan->nr_pids, scan->mapped, 
+		now_sec() - start);
+	return NULL;
+}
+
+/*
+ * Export
+ * 	probe export appends the module's finalized namespace records
+ * 	to FILE, hash-chained (see struct export_file_header), then
+ * 	tells the module to free them. Records are written and synced
+ * 	before the trim, so a crash may repeat records but never
+ * 	loses one: on start the file is replayed, its chain checked,
+ * 	and records it already holds are skipped.
+ */
+
+/* Next record to store for a namespace of a module load */
+struct export_ns {
+	__u32 ns;
+	__u64 epoch;
+	__u64 next;
+	bool trim;		/* stored records not yet trimmed */
+};
+
+struct exporter {
+	FILE *out;
+	int alg;		/* AF_ALG sha256 */
+	__u8 chain[EXPORT_CHAIN_SIZE];
+	struct export_ns *ns;
+	size_t nr_ns, max_ns, last;
+};
+
+static int sha256_open(void)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "hash",
+		.salg_name = "sha256",
+	};
+	int tfm, fd = -1;
+
+	tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+	if (tfm < 0)
+		return -1;
+	if (!bind(tfm, (struct sockaddr *) &sa, sizeof(sa)))
+		fd = accept(tfm, NULL, 0);
+	close(tfm);
+	return fd;
+}
+
+/* chain = SHA256(chain || rec) */
+static int chain_extend(struct exporter *e, const struct export_record *rec)
+{
+	if (send(e->alg, e->chain, EXPORT_CHAIN_SIZE, MSG_MORE) != 
+	    EXPORT_CHAIN_SIZE || 
+	    send(e->alg, rec, rec->size, 0) != (ssize_t) rec->size || 
+	    read(e->alg, e->chain, EXPORT_CHAIN_SIZE) != EXPORT_CHAIN_SIZE)
+		return -1;
+	return 0;
+}
+
+/* Header of a record that has at least sizeof(*rec) bytes */
+static bool export_record_valid(const struct export_record *rec)
+{
+	size_t size = sizeof(*rec) + rec->nr_files * 
+		      sizeof(struct export_digest) + rec->path_len + 1;
+
+	return rec->size == ((size + 7) & ~7UL) && 
+	       rec->length <= MEASUREMENT_DIGEST_MAX;
+}
+
+/* Records of one namespace come together, the last one is cached */
+static struct export_ns *export_ns_get(struct exporter *e, 
+				       const struct export_record *rec)
+{
+	struct export_ns *n;
+	size_t i;
+
+	if (e->last < e->nr_ns && e->ns[e->last].ns == rec->ns)
+		goto found;
+	for (i = 0; i < e->nr_ns; i++) {
+		if (e->ns[i].ns == rec->ns) {
+			e->last = i;
+			goto found;
+		}
+	}
+
+	if (e->nr_ns == e->max_ns) {
+		e->max_ns = e->max_ns ? e->max_ns * 2 : 64;
+		n = realloc(e->ns, e->max_ns * sizeof(*n));
+		if (!n)
+			return NULL;
+		e->ns = n;
+	}
+	e->last = e->nr_ns++;
+	memset(&e->ns[e->last], 0, sizeof(*n));
+	e->ns[e->last].ns = rec->ns;
+found:
+	n = &e->ns[e->last];
+	/* Reloaded module, its logs start over */
+	if (n->epoch != rec->epoch) {
+		n->epoch = rec->epoch;
+		n->next = 0;
+	}
+	return n;
+}
+
+/*
+ * export_recover
+ * 	Replay FILE: check the header and the chain, learn the next
+ * 	record of every namespace and cut a record left incomplete
+ */
+static int export_recover(struct exporter *e, int fd, const char *path)
+{
+	struct export_file_header hdr = { .magic = EXPORT_MAGIC, 
+					  .version = 1 };
+	const struct export_record *rec;
+	struct export_ns *n;
+	struct stat st;
+	size_t off = sizeof(hdr), left;
+	__u8 *base;
+
+	if (fstat(fd, &st))
+		return -1;
+	if (!st.st_size)
+		return write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) ? 0 : -1;
+	if ((size_t) st.st_size < sizeof(hdr))
+		goto bad;
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		return -1;
+	if (memcmp(base, &hdr, sizeof(hdr))) {
+		munmap(base, st.st_size);
+		goto bad;
+	}
+
+	while (off < (size_t) st.st_size) {
+		rec = (const struct export_record *) (base + off);
+		left = st.st_size - off;
+		if (left < sizeof(*rec))
+			break;
+		if (!export_record_valid(rec)) {
+			fprintf(stderr, "%s: bad record at offset %zu\n", 
+				path, off);
+			munmap(base, st.st_size);
+			errno = EINVAL;
+			return -1;
+		}
+		if (left < rec->size + EXPORT_CHAIN_SIZE)
+			break;
+		n = export_ns_get(e, rec);
+		if (!n || chain_extend(e, rec)) {
+			munmap(base, st.st_size);
+			return -1;
+		}
+		if (memcmp(e->chain, base + off + rec->size, 
+			   EXPORT_CHAIN_SIZE)) {
+			fprintf(stderr, "%s: chain broken at offset %zu\n", 
+				path, off);
+			munmap(base, st.st_size);
+			errno = EINVAL;
+			return -1;
+		}
+		if (rec->seq >= n->next)
+			n->next = rec->seq + 1;
+		off += rec->size + EXPORT_CHAIN_SIZE;
+	}
+	munmap(base, st.st_size);
+
+	if (off < (size_t) st.st_size) {
+		fprintf(stderr, "%s: dropping %zu bytes of an incomplete "
+			"record\n", path, (size_t) st.st_size - off);
+		if (ftruncate(fd, off))
+			return -1;
+	}
+	return 0;
+bad:
+	fprintf(stderr, "%s is not an export file\n", path);
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * export_pass
+ * 	Read the finalized records once, append the new ones, sync,
+ * 	then trim them in the module
+ * 	Returns the number of records stored
+ */
+static long export_pass(struct exporter *e, __u8 *buf)
+{
+	const struct export_record *rec;
+	struct export_ns *n;
+	char trim[48];
+	long stored = 0, ret = -1;
+	ssize_t len, off;
+	size_t i;
+	int fd;
+
+	fd = open(MODULE_EXPORT, O_RDWR);
+	if (fd < 0)
+		return -1;
+
+	while ((len = read(fd, buf, EXPORT_BUF)) > 0) {
+		for (off = 0; off < len; off += rec->size) {
+			rec = (const struct export_record *) (buf + off);
+			if ((size_t) (len - off) < sizeof(*rec) || 
+			    !export_record_valid(rec) || rec->size > len - off) {
+				errno = EPROTO;
+				goto out;
+			}
+			n = export_ns_get(e, rec);
+			if (!n)
+				goto out;
+			/* Also trims what a previous run stored */
+			n->trim = true;
+			if (rec->seq < n->next)
+				continue;
+			if (chain_extend(e, rec) || 
+			    fwrite(rec, rec->size, 1, e->out) != 1 || 
+			    fwrite(e->chain, EXPORT_CHAIN_SIZE, 1, e->out) != 1)
+				goto out;
+			n->next = rec->seq + 1;
+			stored++;
+		}
+	}
+	if (len < 0)
+		goto out;
+
+	if (fflush(e->out) || fsync(fileno(e->out)))
+		goto out;
+
+	for (i = 0; i < e->nr_ns; i++) {
+		n = &e->ns[i];
+		if (!n->trim)
+			continue;
+		len = snprintf(trim, sizeof(trim), "%u %llu", n->ns, 
+			       (unsigned long long) n->next);
+		if (write(fd, trim, len) != len)
+			goto out;
+		n->trim = false;
+	}
+	ret = stored;
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * export_command
+ * 	probe export FILE [SECONDS]
+ * 	Export every SECONDS, EXPORT_INTERVAL_SEC by default, until
+ * 	interrupted; 0 exports once
+ */
+static int export_command(const char *prog, int argc, char **argv)
+{
+	struct exporter e = { .alg = -1 };
+	unsigned int interval = EXPORT_INTERVAL_SEC;
+	__u8 *buf = NULL;
+	long stored;
+	char *end;
+	int fd, ret = -1;
+
+	if (argc < 1 || argc > 2) {
+		usage(prog);
+		return -1;
+	}
+	if (argc == 2) {
+		interval = strtoul(argv[1], &end, 10);
+		if (*end || end == argv[1]) {
+			usage(prog);
+			return -1;
+		}
+	}
+
+	fd = open(argv[0], O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[0], 
+			strerror(errno));
+		return -1;
+	}
+
+	e.alg = sha256_open();
+	if (e.alg < 0) {
+		fprintf(stderr, "Failed to open sha256: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (export_recover(&e, fd, argv[0])) {
+		fprintf(stderr, "Failed to read %s: %s\n", argv[0], 
+			strerror(errno));
+		close(fd);
+		goto out;
+	}
+
+	e.out = fdopen(fd, "ab");
+	buf = malloc(EXPORT_BUF);
+	if (!e.out || !buf) {
+		fprintf(stderr, "Failed to set up export\n");
+		if (!e.out)
+			close(fd);
+		goto out;
+	}
+	setvbuf(e.out, NULL, _IOFBF, 1 << 16);
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	do {
+		stored = export_pass(&e, buf);
+		if (stored < 0) {
+			fprintf(stderr, "Failed to export: %s\n", 
+				strerror(errno));
+			goto out;
+		}
+		if (stored)
+			printf("exported %ld records\n", stored);
+		if (interval)
+			sleep(interval);
+	} while (interval && !exiting);
+	ret = 0;
+out:
+	if (e.out)
+		fclose(e.out);
+	close(e.alg);
+	free(e.ns);
+	free(buf);
+	return ret;
+}
+
+static const char *algo_name(__u8 algo)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(policy_algos) / sizeof(policy_algos[0]); i++) {
+		if (policy_algos[i].algo == algo)
+			return policy_algos[i].name;
+	}
+	return "?";
+}
+
+static void print_hex(const __u8 *data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		printf("%02x", data[i]);
+}
+
+/* ascii_measurements format, without the template digest */
+static void print_export_record(const struct export_record *rec)
+{
+	const struct export_digest *files = 
+		(const struct export_digest *) (rec + 1);
+	int i;
+
+	printf("%u %llu %s%s:", rec->ns, (unsigned long long) rec->seq, 
+	       rec->flags & MEASUREMENT_VERITY ? "verity:" : "", 
+	       algo_name(rec->algo));
+	print_hex(rec->digest, rec->length);
+	for (i = 0; i < rec->nr_files; i++) {
+		printf("%s%s:", i ? "," : " files=", 
+		       algo_name(files[i].algo));
+		print_hex(files[i].digest, files[i].length);
+	}
+	printf(" %u:%s\n", rec->ns, (const char *) (files + rec->nr_files));
+}
+
+/*
+ * log_command
+ * 	probe log CONTAINER [SEQ]
+ * 	Print the records of a namespace from SEQ, in batches of
+ * 	NS_READ_IOC. Only the records after SEQ are read, so an
+ * 	agent polling with the last seq + 1 pays for new ones only.
+ */
+static int log_command(const char *prog, int argc, char **argv)
+{
+	const struct export_record *rec;
+	struct container_key key;
+	struct ns_read req = {};
+	__u8 *buf = NULL;
+	__u32 i, off;
+	char *end;
+	int fd, ret = 0;
+
+	if (argc < 1 || argc > 2 || parse_container_key(argv[0], &key) || 
+	    key.type != CONTAINER_KEY_NS) {
+		usage(prog);
+		return -1;
+	}
+	if (argc == 2) {
+		req.seq = strtoull(argv[1], &end, 10);
+		if (*end || end == argv[1]) {
+			usage(prog);
+			return -1;
+		}
+	}
+
+	fd = open(MODULE_EXPORT, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", MODULE_EXPORT, 
+			strerror(errno));
+		return -1;
+	}
+
+	buf = malloc(EXPORT_BUF);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+
+	req.ns = key.id;
+	req.buf = (__u64) (unsigned long) buf;
+	req.len = EXPORT_BUF;
+	do {
+		if (ioctl(fd, NS_READ_IOC, &req)) {
+			fprintf(stderr, "Failed to read namespace %u: %s\n", 
+				req.ns, strerror(errno));
+			ret = -1;
+			break;
+		}
+		for (i = 0, off = 0; i < req.count; i++, off += rec->size) {
+			rec = (const struct export_record *) (buf + off);
+			print_export_record(rec);
+		}
+	} while (req.count);
+
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+
+/*
+ * Pinning
+ * 	With --pin the probe's maps and the links of its hooks live
+ * 	in PIN_DIR, so they outlive the process. The next probe
+ * 	reuses the maps: caches, exec state and counters stay warm.
+ * 	A map whose definition changed is replaced and starts
+ * 	empty, and so is every map when their contents changed
+ * 	meaning, see PIN_LAYOUT. For the hooks, the pinned link is adopted when it
+ * 	runs the same program, otherwise its program is swapped
+ * 	with bpf_link_update. LSM links do not support that yet, so
+ * 	the new program is attached first, takes over the pin and
+ * 	only then is the old link released: both run for a moment,
+ * 	none is ever missing.
+ */
+static bool pin_maps_replaced;
+
+/*
+ * Version of the contents of the pinned maps, kept in PIN_DIR by
+ * a one-entry array. Bump it when a map keeps its definition but
+ * its contents change meaning, such as new hook_counter indices
+ * or a reordered value struct of the same size, which
+ * pin_map_compatible cannot see.
+ */
+#define PIN_LAYOUT 1
+#define PIN_LAYOUT_MAP PIN_DIR "/layout"
+
+/*
+ * pin_layout
+ * 	True when the pinned maps hold PIN_LAYOUT contents.
+ * 	Otherwise pins PIN_LAYOUT for the maps about to be
+ * 	recreated and returns false.
+ */
+static bool pin_layout(void)
+{
+	__u32 key = 0, layout = 0;
+	int fd;
+
+	fd = bpf_obj_get(PIN_LAYOUT_MAP);
+	if (fd >= 0) {
+		if (bpf_map_lookup_elem(fd, &key, &layout))
+			layout = 0;
+		close(fd);
+		if (layout == PIN_LAYOUT)
+			return true;
+		unlink(PIN_LAYOUT_MAP);
+	}
+
+	fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "layout", sizeof(key), 
+			    sizeof(layout), 1, NULL);
+	if (fd < 0)
+		return false;
+	layout = PIN_LAYOUT;
+	if (bpf_map_update_elem(fd, &key, &layout, BPF_ANY) || 
+	    bpf_obj_pin(fd, PIN_LAYOUT_MAP))
+		fprintf(stderr, "Failed to pin %s\n", PIN_LAYOUT_MAP);
+	close(fd);
+	return false;
+}
+
+/* The pinned map, if any, can be reused for map */
+static bool pin_map_compatible(struct bpf_map *map, const char *path)
+{
+	struct bpf_map_info info = {};
+	__u32 len = sizeof(info);
+	bool ok;
+	int fd;
+
+	fd = bpf_obj_get(path);
+	if (fd < 0)
+		return true;
+	ok = !bpf_obj_get_info_by_fd(fd, &info, &len) && 
+	     info.type == bpf_map__type(map) && 
+	     info.key_size == bpf_map__key_size(map) && 
+	     info.value_size == bpf_map__value_size(map) && 
+	     info.max_entries == bpf_map__max_entries(map) && 
+	     info.map_flags == bpf_map__map_flags(map);
+	close(fd);
+	return ok;
+}
+
+/* Before load: reuse the maps pinned by an earlier probe */
+static int pin_maps(struct probe_bpf *skel)
+{
+	char path[PATH_MAX];
+	struct bpf_map *map;
+	bool layout;
+
+	if (mkdir(PIN_DIR, 0700) && errno != EEXIST)
+		return -errno;
+
+	/* Pinned links may still run programs using the old maps */
+	layout = pin_layout();
+	if (!layout)
+		pin_maps_replaced = true;
+
+	bpf_object__for_each_map(map, skel->obj) {
+		/* container_policy has its own pin, .rodata and .bss 
+		 * belong to the program */
+		if (bpf_map__pin_path(map) || bpf_map__is_internal(map))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", PIN_DIR, 
+			 bpf_map__name(map));
+		if (!access(path, F_OK) && 
+		    (!layout || !pin_map_compatible(map, path))) {
+			fprintf(stderr, "%s changed, starting it empty\n", 
+				bpf_map__name(map));
+			unlink(path);
+			pin_maps_replaced = true;
+		}
+		if (bpf_map__set_pin_path(map, path))
+			return -errno;
+	}
+	return 0;
+}
+
+/* The pinned link runs the program prog was loaded from */
+static bool pin_same_prog(struct bpf_link *link, struct bpf_program *prog)
+{
+	struct bpf_link_info link_info = {};
+	struct bpf_prog_info old = {}, new = {};
+	__u32 len;
+	bool same = false;
+	int fd;
+
+	len = sizeof(link_info);
+	if (bpf_obj_get_info_by_fd(bpf_link__fd(link), &link_info, &len))
+		return false;
+	len = sizeof(new);
+	if (bpf_obj_get_info_by_fd(bpf_program__fd(prog), &new, &len))
+		return false;
+
+	fd = bpf_prog_get_fd_by_id(link_info.prog_id);
+	if (fd < 0)
+		return false;
+	len = sizeof(old);
+	if (!bpf_obj_get_info_by_fd(fd, &old, &len))
+		same = !memcmp(old.tag, new.tag, sizeof(old.tag));
+	close(fd);
+	return same;
+}
+
+/*
+ * pin_attach
+ * 	Adopt, update or replace the link pinned for prog, see
+ * 	Pinning. *linkp receives the link now pinned.
+ */
+static int pin_attach(struct bpf_program *prog, struct bpf_link **linkp)
+{
+	struct bpf_link *old, *link;
+	char path[PATH_MAX];
+	int err;
+
+	snprintf(path, sizeof(path), "%s/link_%s", PIN_DIR, 
+		 bpf_program__name(prog));
+	old = bpf_link__open(path);
+	if (old) {
+		/* Maps were recreated, the old program has the old ones */
+		if (!pin_maps_replaced && pin_same_prog(old, prog)) {
+			*linkp = old;
+			return 0;
+		}
+		if (!bpf_link__update_program(old, prog)) {
+			*linkp = old;
+			return 0;
+		}
+	}
+
+	link = bpf_program__attach(prog);
+	if (!link) {
+		err = -errno;
+		bpf_link__destroy(old);
+		return err;
+	}
+	if (old)
+		unlink(path);
+	if (bpf_link__pin(link, path)) {
+		err = -errno;
+		bpf_link__destroy(link);
+		bpf_link__destroy(old);
+		return err;
+	}
+
+	/* Last reference, the old program detaches */
+	bpf_link__destroy(old);
+	*linkp = link;
+	return 0;
+}
+
+static int pin_attach_all(struct probe_bpf *skel)
+{
+	int err;
+
+	err = pin_attach(skel->progs.mmap_hook, &skel->links.mmap_hook);
+	if (!err)
+		err = pin_attach(skel->progs.bprm_hook, &skel->links.bprm_hook);
+	return err;
+}
+
+/*
+ * detach_command
+ * 	probe detach
+ * 	Unpin what --pin left, the hooks detach once no probe holds
+ * 	their links. The container policy stays.
+ */
+static int detach_command(void)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	int ret = 0;
+	DIR *dir;
+
+	dir = opendir(PIN_DIR);
+	if (!dir) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "Failed to open %s: %s\n", PIN_DIR, 
+			strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", PIN_DIR, de->d_name);
+		if (unlink(path)) {
+			fprintf(stderr, "Failed to unpin %s: %s\n", path, 
+				strerror(errno));
+			ret = -1;
+		}
+	}
+	closedir(dir);
+
+	if (!ret && rmdir(PIN_DIR))
+		ret = -1;
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-o FILE] [-s SECONDS] [-f FILE] [-H] [-P] "
+		"[-S[THREADS]]\n"
+		"  -o, --output FILE    write measurement events to FILE "
+		"(- for stdout)\n"
+		"  -s, --stats SECONDS  print latency percentiles every "
+		"SECONDS\n"
+		"  -f, --filter FILE    load pre-filter rules from FILE, "
+		"reloaded on SIGHUP\n"
+		"  -H, --measure-host   do not filter out the host "
+		"namespace\n"
+		"  -O, --opt-in         only measure containers with a "
+		"policy\n"
+		"  -P, --pin            keep hooks and maps pinned in "
+		"bpffs after exit,\n"
+		"                       taken over by the next probe\n"
+		"  -S, --scan[=THREADS] measure the executable mappings of "
+		"running\n"
+		"                       processes with THREADS (default: "
+		"CPUs)\n"
+		"\n"
+		"       %s policy set CONTAINER off|measure[:ALGO] "
+		"[mmap,exec|all]\n"
+		"       %s policy del CONTAINER\n"
+		"       %s policy list\n"
+		"  CONTAINER is ns:INUM, ns:PATH, pid:PID, cgroup:ID or "
+		"cgroup:PATH\n"
+		"       %s export FILE [SECONDS]\n"
+		"  append finalized namespace records to FILE every SECONDS "
+		"(default %d, 0: once)\n"
+		"       %s log CONTAINER [SEQ]\n"
+		"  print the namespace records of CONTAINER from SEQ\n"
+		"       %s detach\n"
+		"  remove the hooks and maps left by --pin\n", 
+		prog, prog, prog, prog, prog, EXPORT_INTERVAL_SEC, prog, prog);
+}
 
 int cleanup(struct probe_bpf *skel)
 {
@@ -27,29 +1739,189 @@ static int libbpf_print_fn(enum libbpf_print_level level,
 
 int main(int argc, char **argv)
 {
+    static const struct option long_opts[] = {
+	{ "output", required_argument, NULL, 'o' },
+	{ "stats", required_argument, NULL, 's' },
+	{ "filter", required_argument, NULL, 'f' },
+	{ "measure-host", no_argument, NULL, 'H' },
+	{ "opt-in", no_argument, NULL, 'O' },
+	{ "pin", no_argument, NULL, 'P' },
+	{ "scan", optional_argument, NULL, 'S' },
+	{ "help", no_argument, NULL, 'h' },
+	{ },
+    };
     struct probe_bpf *skel;
-    int ret;
+    struct ring_buffer *rb = NULL;
+    const char *output = NULL, *filter_path = NULL;
+    double stats_interval = 0, last_stats;
+    struct filter *filter = NULL;
+    bool measure_host = false, opt_in = false, scanning = false;
+    bool pin = false, pinned = false;
+    struct scan scan = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    FILE *out = NULL;
+    int ret, opt;
+
+    if (argc > 1 && !strcmp(argv[1], "policy"))
+	return policy_command(argv[0], argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "export"))
+	return export_command(argv[0], argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "log"))
+	return log_command(argv[0], argc - 2, argv + 2);
+    if (argc == 2 && !strcmp(argv[1], "detach"))
+	return detach_command();
+
+    while ((opt = getopt_long(argc, argv, "o:s:f:HOPS::h", long_opts, 
+			    NULL)) != -1) {
+	switch (opt) {
+	case 'o':
+	    output = optarg;
+	    break;
+	case 's':
+	    stats_interval = atof(optarg);
+	    break;
+	case 'f':
+	    filter_path = optarg;
+	    break;
+	case 'H':
+	    measure_host = true;
+	    break;
+	case 'O':
+	    opt_in = true;
+	    break;
+	case 'P':
+	    pin = true;
+	    break;
+	case 'S':
+	    scan.threads = optarg ? atoi(optarg) : 
+		    sysconf(_SC_NPROCESSORS_ONLN);
+	    if (scan.threads < 1) {
+		usage(argv[0]);
+		return -1;
+	    }
+	    if (scan.threads > SCAN_THREADS_MAX)
+		scan.threads = SCAN_THREADS_MAX;
+	    break;
+	default:
+	    usage(argv[0]);
+	    return opt == 'h' ? 0 : -1;
+	}
+    }
+
+    if (output) {
+	out = strcmp(output, "-") ? fopen(output, "ab") : stdout;
+	if (!out) {
+	    fprintf(stderr, "Failed to open %s: %s\n", output, 
+			    strerror(errno));
+	    return -1;
+	}
+	setvbuf(out, NULL, _IOFBF, 1 << 16);
+    }
+
+    filter = malloc(sizeof(*filter));
+    if (!filter || filter_build(filter, filter_path, measure_host, 
+			    opt_in)) {
+	fprintf(stderr, "Failed to load filter\n");
+	free(filter);
+	return -1;
+    }
+
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    signal(SIGHUP, sig_handler);
 
     libbpf_set_print(libbpf_print_fn);
 
-    skel = probe_bpf__open_and_load();
+    skel = probe_bpf__open();
     if (!skel) {
 	fprintf(stderr, "Failed to open BPF skeleton\n");
         return -1;
     }
 
+    ret = pin ? pin_maps(skel) : 0;
+    if (ret) {
+	fprintf(stderr, "Failed to pin maps: %s\n", strerror(-ret));
+	goto cleanup;
+    }
 
-    ret = probe_bpf__attach(skel);
+    ret = probe_bpf__load(skel);
+    if (ret) {
+	fprintf(stderr, "Failed to load BPF skeleton\n");
+	goto cleanup;
+    }
+
+    /* Filter before attaching, nothing unwanted reaches the module */
+    ret = filter_apply(skel, filter);
+    if (ret) {
+	fprintf(stderr, "Failed to apply filter: %s\n", strerror(-ret));
+	goto cleanup;
+    }
+
+    /* Pinned, an earlier probe's hooks are taken over without a gap */
+    ret = pin ? pin_attach_all(skel) : probe_bpf__attach(skel);
     if (ret) {
 	fprintf(stderr, "Failed to attach BPF skeleton\n");
 	goto cleanup;
     }
+    pinned = pin;
+
+    /* ring_buffer__poll waits on epoll and drains every ready record */
+    rb = ring_buffer__new(bpf_map__fd(skel->maps.events), handle_event, 
+		    out, NULL);
+    if (!rb) {
+	fprintf(stderr, "Failed to create ring buffer\n");
+	goto cleanup;
+    }
 
-    while(1) {
-	sleep(5);
-    }	
+    /* Catch up with running containers while events are drained */
+    if (scan.threads) {
+	scan.target_fd = bpf_map__fd(skel->maps.scan_target);
+	scan.host_ns = host_ns();
+	scan.measure_host = measure_host;
+	scanning = !pthread_create(&scan.thread, NULL, scan_main, &scan);
+	if (!scanning)
+	    fprintf(stderr, "Failed to start scan\n");
+    }
+
+    last_stats = now_sec();
+    while (!exiting) {
+	if (reload) {
+	    reload = 0;
+	    if (!filter_build(filter, filter_path, measure_host, opt_in)) {
+		ret = filter_apply(skel, filter);
+		if (ret)
+		    fprintf(stderr, "Failed to apply filter: %s\n", 
+				    strerror(-ret));
+	    }
+	}
+
+	if (stats_interval > 0 && now_sec() - last_stats >= stats_interval) {
+	    print_stats(skel);
+	    last_stats = now_sec();
+	}
+
+	ret = ring_buffer__poll(rb, POLL_TIMEOUT_MS);
+	if (ret == -EINTR)
+	    continue;
+	if (ret < 0) {
+	    fprintf(stderr, "Failed to poll ring buffer: %d\n", ret);
+	    break;
+	}
+	if (ret && out)
+	    fflush(out);
+    }
 
 cleanup:
+    if (scanning)
+	pthread_join(scan.thread, NULL);
+    free(scan.pids);
+    free(scan.seen);
+    ring_buffer__free(rb);
+    free(filter);
+    if (out && out != stdout)
+	fclose(out);
+    if (pinned)
+	fprintf(stderr, "Hooks stay attached in %s until probe detach\n", 
+		PIN_DIR);
     cleanup(skel);
     return 0;
 }
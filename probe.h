@@ -0,0 +1,193 @@
+/*
+ * File: probe.h
+ * 	Definitions shared by the eBPF probe and
+ * 	its userspace loader
+ */
+#ifndef __PROBE_H__
+#define __PROBE_H__
+
+#define MEASUREMENT_DIGEST_MAX 64
+
+/*
+ * Measurement event, sent through the events ring buffer
+ * and written as is by probe -o
+ */
+struct measurement_event {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC at the mmap hook */
+	__u64 duration_ns;	/* time spent in the module */
+	__u64 ino;		/* overlay files: of the backing inode */
+	__u32 dev;		/* kernel dev_t, major << 20 | minor */
+	__u32 ns;
+	__u32 pid;
+	__u8 algo;		/* enum hash_algo */
+	__u8 digest_len;
+	__u8 flags;		/* MEASUREMENT_* */
+	__u8 pad;
+	__u8 digest[MEASUREMENT_DIGEST_MAX];
+};
+
+/* measurement_event flags */
+#define MEASUREMENT_VERITY 0x01	/* of the fs-verity digest, not the file */
+
+/*
+ * Record of the module's securityfs export file, matches struct
+ * ima_export_record in container_ima.h. Followed by nr_files
+ * struct export_digest and the NUL-terminated path, padded to a
+ * multiple of 8 bytes.
+ */
+struct export_digest {
+	__u8 algo;
+	__u8 length;
+	__u8 digest[MEASUREMENT_DIGEST_MAX];
+};
+
+struct export_record {
+	__u32 size;		/* of the whole record */
+	__u32 ns;
+	__u64 epoch;		/* module load, the vPCR starts over */
+	__u64 seq;		/* position in the namespace log */
+	__u8 template_digest[32];	/* extended into the vPCR */
+	__u8 algo;		/* enum hash_algo */
+	__u8 length;
+	__u8 flags;		/* MEASUREMENT_* */
+	__u8 nr_files;		/* hash_algos file digests */
+	__u16 path_len;		/* without the NUL */
+	__u16 pad;
+	__u8 digest[MEASUREMENT_DIGEST_MAX];	/* namespaced measurement */
+};
+
+/*
+ * Read the records of one namespace from seq, ioctl on the
+ * module's export file. Matches struct ima_ns_read in
+ * container_ima.h.
+ */
+struct ns_read {
+	__u32 ns;
+	__u32 count;		/* records returned */
+	__u64 seq;		/* first wanted, then the next one */
+	__u64 buf;		/* struct export_record buffer */
+	__u32 len;
+	__u32 pad;
+};
+
+#define NS_READ_IOC _IOWR(0xCA, 1, struct ns_read)
+
+/*
+ * probe export file: an export_file_header, then every
+ * export_record followed by the running hash
+ * 	chain = SHA256(previous chain || record)
+ * starting from zeros, so any later change breaks the chain
+ */
+#define EXPORT_MAGIC "CIMAEXP1"
+#define EXPORT_CHAIN_SIZE 32
+
+struct export_file_header {
+	char magic[8];		/* EXPORT_MAGIC */
+	__u32 version;		/* 1 */
+	__u32 pad;
+};
+
+/* probe --scan worker threads, scan_target entries */
+#define SCAN_THREADS_MAX 256
+
+/* Process a probe --scan thread maps files for, see scan_pid */
+struct scan_target {
+	__u64 cgroup;		/* cgroup v2 id, 0: the probe's */
+	__u32 pid;		/* whose credentials IMA policy sees */
+	__u32 pad;
+};
+
+/* log2 latency histogram, slot b counts [2^(b-1), 2^b) ns */
+#define HIST_BUCKETS 32
+
+struct hist {
+	__u64 slots[HIST_BUCKETS];
+};
+
+/* stage_hist keys */
+enum hook_stage {
+	HOOK_STAGE_MMAP,	/* whole mmap_hook for PROT_EXEC mappings */
+	HOOK_STAGE_KFUNC,	/* bpf_process_measurement call */
+	HOOK_STAGE_BPRM,	/* whole bprm_hook */
+	HOOK_STAGE_MAX
+};
+
+/* counters keys */
+enum hook_counter {
+	HOOK_FAST_PATH,		/* skipped through inode_ns_map */
+	HOOK_KFUNC_CALLS,
+	HOOK_EVENTS_DROPPED,	/* ring buffer full */
+	HOOK_FILTER_NS,		/* dropped by filter_ns */
+	HOOK_FILTER_MAGIC,	/* dropped by filter_magic */
+	HOOK_FILTER_SIZE,	/* dropped by filter_config size bounds */
+	HOOK_FILTER_PATH,	/* dropped by filter_path */
+	HOOK_POLICY_OFF,	/* container policy off or missing */
+	HOOK_EXEC_COALESCED,	/* covered by the exec's bprm measurement */
+	HOOK_COUNTER_MAX
+};
+
+/*
+ * Pre-filter, applied by mmap_hook before calling into the
+ * module. Values of filter_magic and filter_path, and the
+ * defaults used when no entry matches.
+ */
+enum filter_action {
+	FILTER_MEASURE,
+	FILTER_SKIP,
+};
+
+/* filter_config value, single entry at key 0 */
+struct filter_config {
+	__u64 min_size;		/* skip files smaller than this */
+	__u64 max_size;		/* skip files larger than this, 0: no limit */
+	__u8 magic_default;	/* enum filter_action */
+	__u8 path_default;	/* enum filter_action */
+	__u8 path_rules;	/* filter_path is not empty */
+	__u8 policy_required;	/* skip containers without a policy */
+	__u8 pad[4];
+};
+
+/* filter_path key, the longest matching prefix decides */
+#define FILTER_PATH_MAX 256
+
+struct filter_path_key {
+	__u32 prefixlen;	/* in bits */
+	char path[FILTER_PATH_MAX];
+};
+
+/*
+ * Per-container policy, container_policy map. Containers are
+ * identified by uts namespace inum or cgroup id; the namespace
+ * entry is looked up first. Without an entry the host IMA policy
+ * decides, unless filter_config.policy_required is set.
+ */
+enum container_key_type {
+	CONTAINER_KEY_NS,
+	CONTAINER_KEY_CGROUP,
+};
+
+struct container_key {
+	__u32 type;		/* enum container_key_type */
+	__u32 pad;
+	__u64 id;
+};
+
+enum container_mode {
+	CONTAINER_OFF,		/* never measured */
+	CONTAINER_MEASURE,	/* measured with IMA's hash algorithm */
+	CONTAINER_MEASURE_ALGO,	/* measured with algo */
+};
+
+/* container_policy.hooks */
+#define CONTAINER_HOOK_MMAP (1 << 0)	/* PROT_EXEC mmap */
+#define CONTAINER_HOOK_BPRM (1 << 1)	/* execve of the file */
+#define CONTAINER_HOOKS_ALL (CONTAINER_HOOK_MMAP | CONTAINER_HOOK_BPRM)
+
+struct container_policy {
+	__u8 mode;		/* enum container_mode */
+	__u8 algo;		/* enum hash_algo, CONTAINER_MEASURE_ALGO */
+	__u16 hooks;		/* CONTAINER_HOOK_* measured */
+	__u32 pad;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# vpcr_check.sh
+# 	Replay the namespace logs against the vPCRs and their
+# 	entries in the IMA measurement list
+#
+# Usage: vpcr_check.sh
+# 	Replays container_ima/ascii_measurements per namespace from
+# 	zeros, vPCR = SHA256(vPCR || template digest), and checks:
+# 	- container_ima/vpcrs holds the replayed count and vPCR;
+# 	- with tpm_batch set, every "NS:container-ima-vpcr" entry of
+# 	  IMA's ascii_runtime_measurements is a vPCR the replay went
+# 	  through, and the last entry of each namespace is its final
+# 	  vPCR once the pending flush has run.
+#
+# 	Run it once nothing maps files any more. Trimmed logs cannot
+# 	be replayed, so no probe export may have run. Needs awk and
+# 	sha256sum.
+#
+set -eu
+
+SECURITYFS=/sys/kernel/security
+PARAMS=/sys/module/container_ima/parameters
+ZERO=0000000000000000000000000000000000000000000000000000000000000000
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail() {
+	echo "vpcr: FAIL: $*" >&2
+	exit 1
+}
+
+# SHA-256 of the bytes a hex string spells, as hex
+sha256_hex() {
+	# shellcheck disable=SC2059
+	printf "$(echo "$1" | awk '{
+		for (i = 1; i < length($0); i += 2)
+			printf "\\%03o", (index("0123456789abcdef", \
+				substr($0, i, 1)) - 1) * 16 + \
+				index("0123456789abcdef", substr($0, i + 1, 1)) - 1
+	}')" | sha256sum | cut -d ' ' -f 1
+}
+
+grep -q '^trimmed 0$' /sys/kernel/debug/container_ima/memory ||
+	fail "records were trimmed, the logs cannot be replayed"
+
+batch=$(cat "$PARAMS/tpm_batch")
+interval=$(cat "$PARAMS/tpm_interval_ms")
+
+# Let the pending namespaces reach the TPM
+[ "$batch" -eq 0 ] || sleep $((interval * 2 / 1000 + 1))
+
+# ns seq template-digest, grouped by namespace in log order
+awk '{ print $1, $2, $3 }' "$SECURITYFS/container_ima/ascii_measurements" |
+	sort -k1,1n -k2,2n >"$tmp/records"
+
+# Every vPCR value of the replay, and the final one per namespace
+ns=
+count=0
+vpcr=$ZERO
+: >"$tmp/replay"
+: >"$tmp/final"
+while read -r rns seq digest; do
+	if [ "$rns" != "$ns" ]; then
+		[ -z "$ns" ] || echo "$ns $count $vpcr" >>"$tmp/final"
+		ns=$rns
+		count=0
+		vpcr=$ZERO
+	fi
+	[ "$seq" -eq "$count" ] || fail "namespace $ns: record $seq, expected $count"
+	vpcr=$(sha256_hex "$vpcr$digest")
+	count=$((count + 1))
+	echo "$ns $vpcr" >>"$tmp/replay"
+done <"$tmp/records"
+[ -z "$ns" ] || echo "$ns $count $vpcr" >>"$tmp/final"
+
+sort -k1,1n "$SECURITYFS/container_ima/vpcrs" >"$tmp/vpcrs"
+sort -k1,1n -o "$tmp/final" "$tmp/final"
+cmp -s "$tmp/final" "$tmp/vpcrs" || {
+	diff "$tmp/vpcrs" "$tmp/final" >&2 || true
+	fail "vpcrs differ from the replayed logs"
+}
+
+namespaces=$(wc -l <"$tmp/final")
+if [ "$batch" -eq 0 ]; then
+	echo "vpcr: ok, $namespaces namespaces (tpm_batch 0, no IMA entries)"
+	exit 0
+fi
+
+# 11 template-hash template [ima:]sha256:vPCR NS:container-ima-vpcr
+awk '$5 ~ /^[0-9]+:container-ima-vpcr$/ {
+	split($5, name, ":")
+	sub(/^.*:/, "", $4)
+	print name[1], $4
+}' "$SECURITYFS/ima/ascii_runtime_measurements" >"$tmp/entries"
+
+entries=$(wc -l <"$tmp/entries")
+[ "$entries" -gt 0 ] || fail "no container-ima-vpcr entries in the IMA list"
+
+while read -r ens evpcr; do
+	grep -qx "$ens $evpcr" "$tmp/replay" ||
+		fail "namespace $ens: IMA entry $evpcr is not in its log"
+done <"$tmp/entries"
+
+while read -r ns count vpcr; do
+	last=$(awk -v ns="$ns" '$1 == ns { v = $2 } END { print v }' \
+		"$tmp/entries")
+	[ "$last" = "$vpcr" ] ||
+		fail "namespace $ns: last IMA entry ${last:-none}, vPCR $vpcr"
+done <"$tmp/final"
+
+echo "vpcr: ok, $namespaces namespaces, $entries IMA entries"